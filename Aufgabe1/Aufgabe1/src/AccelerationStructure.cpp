@@ -0,0 +1,180 @@
+#include "AccelerationStructure.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <numeric>
+#include <limits>
+
+namespace {
+	// packets one thread of a batch traces at a time
+	const size_t BATCH_GRAIN = 64;
+
+	// spreads the lower 10 bits of the value to every third bit
+	uint32_t spreadBits(uint32_t value) {
+		value &= 0x3FF;
+		value = (value | (value << 16)) & 0x030000FF;
+		value = (value | (value << 8)) & 0x0300F00F;
+		value = (value | (value << 4)) & 0x030C30C3;
+		value = (value | (value << 2)) & 0x09249249;
+		return value;
+	}
+
+	// sort key of a ray, the octant of its direction followed by the Morton code of its origin inside the bounds
+	uint64_t rayKey(const glm::vec3& origin, const glm::vec3& direction, const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+		uint32_t octant = (direction.x < 0.0f ? 1 : 0) | (direction.y < 0.0f ? 2 : 0) | (direction.z < 0.0f ? 4 : 0);
+		uint32_t morton = 0;
+		for (int axis = 0; axis < 3; axis++) {
+			float extent = boundsMax[axis] - boundsMin[axis];
+			float cell = extent > 0.0f ? glm::clamp((origin[axis] - boundsMin[axis]) / extent, 0.0f, 1.0f) * 1023.0f : 0.0f;
+			morton |= spreadBits((uint32_t)cell) << axis;
+		}
+		return ((uint64_t)octant << 30) | morton;
+	}
+}
+
+void AccelerationStructure::build(std::vector<Triangle>& triangles, float minVal, float maxVal, const BuildSettings& settings) {
+	build(triangles.data(), (uint32_t)triangles.size(), minVal, maxVal, settings);
+}
+
+UpdateResult AccelerationStructure::update(const std::vector<uint32_t>& changed, const std::vector<glm::mat4>& modelMatrices) {
+	for (size_t i = 0; i < changed.size(); i++) {
+		triangleData[changed[i]] = Triangle(modelMatrices[i]);
+	}
+	return update(changed);
+}
+
+RayHit AccelerationStructure::query(const glm::vec3& origin, const glm::vec3& direction, float tmax, TraversalContext& context) const {
+	RayHit result;
+	TriangleHit hit;
+	Triangle* triangle = findHit(&origin.x, &direction.x, tmax, hit, context);
+	if (triangle == nullptr)
+		return result;
+	result.t = hit.t;
+	result.point = origin + hit.t * direction;
+	result.triangle = (uint32_t)(triangle - triangleData);
+	result.u = hit.u;
+	result.v = hit.v;
+	return result;
+}
+
+Triangle* AccelerationStructure::searchHit(const float* point, const float* direction, float tmax) {
+	TriangleHit hit;
+	Triangle* result = findHit(point, direction, tmax, hit, threadContext());
+	if (result != nullptr)
+		lastPoint = glm::vec3(point[0], point[1], point[2]) + hit.t * glm::vec3(direction[0], direction[1], direction[2]);
+	return result;
+}
+
+void AccelerationStructure::searchPacket(int count, const glm::vec3* origins, const glm::vec3* directions, float tmax, Triangle** results, TriangleHit* hits, TraversalContext& context) const {
+	for (int i = 0; i < count; i++) {
+		results[i] = findHit(&origins[i].x, &directions[i].x, tmax, hits[i], context);
+	}
+}
+
+const ArenaArray<Box>& AccelerationStructure::nodeBoxes() {
+	if (!boxesStored) {
+		storeBoxes();
+		boxesStored = true;
+	}
+	return boxes;
+}
+
+TraversalContext& AccelerationStructure::threadContext() {
+	thread_local TraversalContext context;
+	return context;
+}
+
+ThreadPool& AccelerationStructure::batchPool(const BatchSettings& batchSettings, std::unique_ptr<ThreadPool>& ownPool) {
+	if (batchSettings.pool != nullptr)
+		return *batchSettings.pool;
+	ownPool.reset(new ThreadPool(batchSettings.threads));
+	return *ownPool;
+}
+
+// the planes are sums and differences of the rows of the matrix, glm stores the matrix by column
+// they are not normalised, which doesn't change on which side of them a point lies
+Frustum Frustum::fromMatrix(const glm::mat4& viewProjection) {
+	glm::mat4 rows = glm::transpose(viewProjection);
+	Frustum frustum;
+	for (int axis = 0; axis < 3; axis++) {
+		frustum.planes[2 * axis] = rows[3] + rows[axis];
+		frustum.planes[2 * axis + 1] = rows[3] - rows[axis];
+	}
+	return frustum;
+}
+
+Frustum Frustum::fromBox(const glm::vec3& boxMin, const glm::vec3& boxMax) {
+	Frustum frustum;
+	for (int axis = 0; axis < 3; axis++) {
+		glm::vec4 normal(0.0f);
+		normal[axis] = 1.0f;
+		frustum.planes[2 * axis] = glm::vec4(glm::vec3(normal), -boxMin[axis]);
+		frustum.planes[2 * axis + 1] = glm::vec4(-glm::vec3(normal), boxMax[axis]);
+	}
+	return frustum;
+}
+
+void HitBuffer::resize(size_t count) {
+	t.resize(count);
+	triangle.resize(count);
+	u.resize(count);
+	v.resize(count);
+}
+
+// the rays are cut into packets of MAX_PACKET consecutive rays, which the threads of the pool take in chunks
+// every ray only writes its own entry of the hit buffer
+void AccelerationStructure::searchBatch(size_t count, const glm::vec3* origins, const glm::vec3* directions, float tmax, HitBuffer& hits, const BatchSettings& batchSettings) const {
+	hits.resize(count);
+	std::unique_ptr<ThreadPool> ownPool;
+	ThreadPool& pool = batchPool(batchSettings, ownPool);
+
+	// neighbouring rays of the sorted order start close to each other and point into the same octant,
+	// so a packet shares the sides of the split planes and finds the nodes it visits in the cache
+	std::vector<uint32_t> order;
+	if (batchSettings.sortRays) {
+		std::vector<uint64_t> keys(count);
+		pool.parallelFor(count, BATCH_GRAIN * MAX_PACKET, [&](size_t begin, size_t end) {
+			for (size_t ray = begin; ray < end; ray++) {
+				keys[ray] = rayKey(origins[ray], directions[ray], boundsMin, boundsMax);
+			}
+		});
+		order.resize(count);
+		std::iota(order.begin(), order.end(), 0u);
+		pool.parallelSort(order, [&](uint32_t first, uint32_t second) {
+			return keys[first] < keys[second] || (keys[first] == keys[second] && first < second);
+		});
+	}
+
+	size_t packetCount = (count + MAX_PACKET - 1) / MAX_PACKET;
+	pool.parallelFor(packetCount, BATCH_GRAIN, [&](size_t begin, size_t end) {
+		uint32_t rays[MAX_PACKET];
+		glm::vec3 packetOrigins[MAX_PACKET], packetDirections[MAX_PACKET];
+		Triangle* results[MAX_PACKET];
+		TriangleHit packetHits[MAX_PACKET];
+		TraversalContext context;
+		for (size_t packet = begin; packet < end; packet++) {
+			size_t first = packet * MAX_PACKET;
+			int size = (int)std::min<size_t>(MAX_PACKET, count - first);
+			for (int i = 0; i < size; i++) {
+				rays[i] = order.empty() ? (uint32_t)(first + i) : order[first + i];
+				packetOrigins[i] = origins[rays[i]];
+				packetDirections[i] = directions[rays[i]];
+			}
+			searchPacket(size, packetOrigins, packetDirections, tmax, results, packetHits, context);
+
+			for (int i = 0; i < size; i++) {
+				uint32_t ray = rays[i];
+				if (results[i] == nullptr) {
+					hits.t[ray] = std::numeric_limits<float>::infinity();
+					hits.triangle[ray] = HitBuffer::NO_HIT;
+					hits.u[ray] = 0.0f;
+					hits.v[ray] = 0.0f;
+					continue;
+				}
+				hits.t[ray] = packetHits[i].t;
+				hits.triangle[ray] = (uint32_t)(results[i] - triangleData);
+				hits.u[ray] = packetHits[i].u;
+				hits.v[ray] = packetHits[i].v;
+			}
+		}
+	});
+}
@@ -0,0 +1,175 @@
+#pragma once
+#include "Triangle.h"
+#include "Box.h"
+#include "Arena.h"
+#include "Intersection.h"
+#include <vector>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <glm/glm.hpp>
+
+class ThreadPool;
+
+// strategy used to place the split planes while building the tree
+enum class BuildMode {
+	Median,		// split at the median centroid of the axis with the largest spread
+	SAH,		// surface area heuristic, evaluated with an exact sweep over the triangle bounds
+	Binned		// approximate surface area heuristic evaluated on a fixed number of bins, fast enough for frequent rebuilds
+};
+
+// parameters of the tree construction
+struct BuildSettings {
+	BuildMode mode = BuildMode::Median;
+	float traversalCost = 1.0f;		// SAH cost of visiting a node
+	float intersectionCost = 1.5f;	// SAH cost of testing a triangle
+	unsigned int threads = 1;		// threads used for the build, 0 uses every hardware thread
+	int bins = 32;					// candidate planes per axis of the binned build
+	int maxLeafSize = 4;			// nodes with at most this many triangles become leaves
+	int maxDepth = 0;				// deepest level of the tree, 0 derives it from the triangle count
+	bool exactClipping = false;		// bound triangles crossing a split plane by their part inside the child instead of their whole bounds
+	bool hugePages = false;			// back the tree memory with transparent huge pages where the system supports them
+	float rebuildThreshold = 1.3f;	// growth of the SAH cost since the last build at which an update rebuilds
+	bool lazy = false;				// leave nodes unsplit until the first query reaches them
+};
+
+// what an update of the tree had to do
+enum class UpdateResult {
+	Refit,			// the moved triangles only changed their leaves
+	PartialRebuild,	// the subtree responsible for most of the cost growth was built again
+	FullRebuild		// the whole tree was built again
+};
+
+// size and quality of a built structure
+struct AccelerationStats {
+	size_t nodes = 0;
+	size_t leaves = 0;
+	size_t references = 0;		// triangles referenced by the leaves, a triangle in several leaves counts several times
+	int depth = 0;				// level of the deepest leaf, the root is level 0
+	size_t bytes = 0;			// memory of the nodes and the leaf lists
+	float expectedCost = 0.0f;	// SAH cost of a ray through the scene
+};
+
+// hits of a batch of rays, one entry per ray in the order of the rays
+struct HitBuffer {
+	static const uint32_t NO_HIT = UINT32_MAX;
+	std::vector<float> t;				// distance along the ray in multiples of its direction
+	std::vector<uint32_t> triangle;		// index of the triangle that was hit, NO_HIT if the ray hit nothing
+	std::vector<float> u, v;			// barycentric coordinates of the hit, the weights of corner 1 and corner 2
+
+	void resize(size_t count);
+};
+
+// closest hit of a query, returned by value so the structure stays unchanged
+struct RayHit {
+	float t = std::numeric_limits<float>::infinity();	// distance along the ray in multiples of its direction, infinite for a miss
+	glm::vec3 point = glm::vec3(0.0f);		// where the ray hits the triangle
+	uint32_t triangle = HitBuffer::NO_HIT;	// index of the triangle in triangleData
+	float u = 0.0f, v = 0.0f;				// barycentric coordinates, the weights of corner 1 and corner 2
+
+	bool found() const { return triangle != HitBuffer::NO_HIT; };
+};
+
+// triangle found by a neighbour query, the centroid of a triangle is the mean of its corners
+struct Neighbour {
+	uint32_t triangle;	// index of the triangle in triangleData
+	float distance;		// distance of its centroid from the query point
+};
+
+// neighbours of a batch of queries, the neighbours of query i are neighbours[first[i]] up to neighbours[first[i + 1]]
+// every query's neighbours are ordered by distance
+struct NeighbourBuffer {
+	std::vector<size_t> first;
+	std::vector<Neighbour> neighbours;
+
+	size_t count(size_t query) const { return first[query + 1] - first[query]; };
+};
+
+// convex volume bounded by six planes, a point p lies inside if dot(plane.xyz, p) + plane.w >= 0 for every plane
+struct Frustum {
+	glm::vec4 planes[6];
+
+	// the volume an OpenGL projection maps into the clip cube, for projection * view it is the part of the scene on the screen
+	static Frustum fromMatrix(const glm::mat4& viewProjection);
+	// the six faces of the box
+	static Frustum fromBox(const glm::vec3& boxMin, const glm::vec3& boxMax);
+};
+
+// memory a thread queries the structures with, owned by the caller and reused by every query of that thread
+// the traversal stacks live here, so a query neither allocates nor writes to anything another thread uses
+struct TraversalContext {
+	// enough for every structure, a wide BVH pushes up to 8 children per level and a packet keeps MAX_PACKET intervals per level
+	static const int STACK_SIZE = 1024;
+	uint32_t node[STACK_SIZE];
+	uint32_t count[STACK_SIZE];
+	alignas(32) float entry[STACK_SIZE];	// aligned for the SIMD loads of the packet intervals
+	alignas(32) float exit[STACK_SIZE];
+	Mailbox mailboxes[16];	// one per ray of a packet, a single ray uses the first
+	int base = 0;	// first free entry, a two level structure runs the queries of its bottom level above its own stack
+	std::vector<uint32_t> triangles;	// scratch of the queries that collect triangles, it keeps its memory between them
+};
+
+// how a batch of rays is answered
+struct BatchSettings {
+	unsigned int threads = 0;	// threads tracing the rays, 0 uses every hardware thread
+	ThreadPool* pool = nullptr;	// pool of the caller that traces the rays instead, so a series of batches doesn't start threads for every batch
+	bool sortRays = false;		// trace the rays ordered by direction octant and Morton code of the origin, the hits keep the input order
+};
+
+/**
+ * Spatial index over the triangles of the scene that answers ray queries.
+ * The structures trade build time, memory and query speed differently, so the one to use is picked per workload
+ * by measuring it on the workload.
+ */
+class AccelerationStructure {
+public:
+	static constexpr int MAX_PACKET = 16;	// most rays a packet traversal walks together
+	Triangle* triangleData = nullptr;	// the triangles of the scene, owned by the caller
+	uint32_t triangleCount = 0;
+	BuildSettings settings;
+	// bounds of all triangles
+	glm::vec3 boundsMin = glm::vec3(0.0f);
+	glm::vec3 boundsMax = glm::vec3(0.0f);
+	glm::vec3 lastPoint = glm::vec3(0.0f);	// intersection point of the last hit
+	float degradation = 1.0f;			// SAH cost of the structure relative to its cost when it was built
+
+	virtual ~AccelerationStructure() {};
+
+	// replaces the structure, the memory of the previous build is reused
+	virtual void build(Triangle* triangles, uint32_t count, float minVal, float maxVal, const BuildSettings& settings) = 0;
+	void build(std::vector<Triangle>& triangles, float minVal, float maxVal, const BuildSettings& settings);
+	// the triangles with the given indices have moved
+	virtual UpdateResult update(const std::vector<uint32_t>& changed) = 0;
+	// gives the triangles with the given indices new model matrices and updates the structure
+	UpdateResult update(const std::vector<uint32_t>& changed, const std::vector<glm::mat4>& modelMatrices);
+	// closest hit of the ray from origin in direction within [0, tmax] times the direction
+	// any number of threads may query the structure at once, each with its own context
+	// a lazy KD-tree splits the pending nodes the query reaches, it does so under its own lock
+	RayHit query(const glm::vec3& origin, const glm::vec3& direction, float tmax, TraversalContext& context) const;
+	// returns the closest triangle hit by the ray like query and stores the hit in lastPoint, for a single querying thread
+	Triangle* searchHit(const float* point, const float* direction, float tmax);
+	// the closest hit like query, the triangle is returned and its distance and barycentric coordinates go to hit
+	virtual Triangle* findHit(const float* point, const float* direction, float tmax, TriangleHit& hit, TraversalContext& context) const = 0;
+	// true if the ray hits any triangle within [0, tmax] times the direction, for shadow and visibility rays
+	// it stops at the first hit it finds and records nothing, which makes it cheaper than query
+	virtual bool occluded(const float* point, const float* direction, float tmax, TraversalContext& context) const = 0;
+	// closest hits of count coherent rays, like camera rays through neighbouring pixels
+	// results[i] is the triangle hit by ray i or nullptr and hits[i] where it was hit, lastPoint is not changed
+	// structures without a packet traversal answer the rays one by one
+	virtual void searchPacket(int count, const glm::vec3* origins, const glm::vec3* directions, float tmax, Triangle** results, TriangleHit* hits, TraversalContext& context) const;
+	// closest hits of count rays, traced in packets by a pool of threads, every thread with its own context
+	void searchBatch(size_t count, const glm::vec3* origins, const glm::vec3* directions, float tmax, HitBuffer& hits, const BatchSettings& batchSettings = BatchSettings()) const;
+	virtual AccelerationStats stats() const = 0;
+	// bounds of the nodes for drawing, made on the first call after a build or an update
+	// not safe while other threads query a lazy tree
+	const ArenaArray<Box>& nodeBoxes();
+protected:
+	ArenaArray<Box> boxes;
+	mutable bool boxesStored = false;	// the boxes match the current nodes, a query that splits a node of a lazy tree clears it
+
+	// context of the calling thread for the queries that don't get one from their caller
+	static TraversalContext& threadContext();
+	// the pool of the batch settings, or a new one with their thread count that is kept in ownPool
+	static ThreadPool& batchPool(const BatchSettings& batchSettings, std::unique_ptr<ThreadPool>& ownPool);
+	virtual void storeBoxes() = 0;
+};
@@ -0,0 +1,125 @@
+#include "Arena.h"
+#include <algorithm>
+#include <cstdint>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+Arena::~Arena() {
+	release();
+}
+
+Arena::Arena(Arena&& other) : blocks(std::move(other.blocks)), current(other.current), offset(other.offset), hugePages(other.hugePages) {
+	other.blocks.clear();
+	other.current = 0;
+	other.offset = 0;
+}
+
+Arena& Arena::operator=(Arena&& other) {
+	if (this != &other) {
+		release();
+		blocks.swap(other.blocks);
+		current = other.current;
+		offset = other.offset;
+		hugePages = other.hugePages;
+		other.current = 0;
+		other.offset = 0;
+	}
+	return *this;
+}
+
+void* Arena::allocate(size_t size, size_t alignment) {
+	// the kept blocks are used in order, a block that is too small for the request is skipped until the next reset
+	while (current < blocks.size()) {
+		size_t start = (offset + alignment - 1) / alignment * alignment;
+		if (start + size <= blocks[current].size) {
+			offset = start + size;
+			return blocks[current].memory + start;
+		}
+		current++;
+		offset = 0;
+	}
+
+	// blocks start on a page, which satisfies every alignment the tree needs
+	size_t blockSize = std::max<size_t>((size + BLOCK_SIZE - 1) / BLOCK_SIZE, 1) * BLOCK_SIZE;
+	blocks.push_back({ allocateBlock(blockSize), blockSize });
+	current = blocks.size() - 1;
+	offset = size;
+	return blocks[current].memory;
+}
+
+void Arena::reset() {
+	current = 0;
+	offset = 0;
+}
+
+void Arena::release() {
+	for (const Block& block : blocks) {
+		freeBlock(block);
+	}
+	blocks.clear();
+	current = 0;
+	offset = 0;
+}
+
+size_t Arena::used() const {
+	size_t total = 0;
+	for (size_t i = 0; i < current && i < blocks.size(); i++) {
+		total += blocks[i].size;
+	}
+	return total + offset;
+}
+
+size_t Arena::reserved() const {
+	size_t total = 0;
+	for (const Block& block : blocks) {
+		total += block.size;
+	}
+	return total;
+}
+
+#ifdef _WIN32
+// large pages on Windows need the SeLockMemoryPrivilege, so the blocks always use normal pages here
+char* Arena::allocateBlock(size_t size) {
+	void* memory = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (memory == nullptr)
+		throw std::bad_alloc();
+	return static_cast<char*>(memory);
+}
+
+void Arena::freeBlock(const Block& block) {
+	VirtualFree(block.memory, 0, MEM_RELEASE);
+}
+#else
+char* Arena::allocateBlock(size_t size) {
+	if (!hugePages) {
+		void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (memory == MAP_FAILED)
+			throw std::bad_alloc();
+		return static_cast<char*>(memory);
+	}
+
+	// huge pages are only used for 2 MB aligned ranges, so one huge page more is mapped and the unaligned ends are cut off
+	void* mapped = mmap(nullptr, size + BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapped == MAP_FAILED)
+		throw std::bad_alloc();
+	uintptr_t begin = reinterpret_cast<uintptr_t>(mapped);
+	uintptr_t aligned = (begin + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+	if (aligned > begin)
+		munmap(mapped, aligned - begin);
+	if (aligned + size < begin + size + BLOCK_SIZE)
+		munmap(reinterpret_cast<void*>(aligned + size), begin + BLOCK_SIZE - aligned);
+#ifdef MADV_HUGEPAGE
+	madvise(reinterpret_cast<void*>(aligned), size, MADV_HUGEPAGE);
+#endif
+	return reinterpret_cast<char*>(aligned);
+}
+
+void Arena::freeBlock(const Block& block) {
+	munmap(block.memory, block.size);
+}
+#endif
@@ -0,0 +1,98 @@
+#pragma once
+#include <vector>
+#include <new>
+#include <cstddef>
+#include <type_traits>
+
+// fixed size array whose memory belongs to an arena, it never frees anything itself
+template <typename T>
+struct ArenaArray {
+	T* items = nullptr;
+	size_t count = 0;
+
+	T& operator[](size_t i) { return items[i]; };
+	const T& operator[](size_t i) const { return items[i]; };
+	size_t size() const { return count; };
+	bool empty() const { return count == 0; };
+	T* data() { return items; };
+	const T* data() const { return items; };
+	T* begin() { return items; };
+	T* end() { return items + count; };
+	const T* begin() const { return items; };
+	const T* end() const { return items + count; };
+};
+
+/**
+ * Bump allocator for memory that lives exactly as long as one build of a tree.
+ * Nothing is freed on its own: reset() forgets every allocation at once and keeps the blocks for the next build,
+ * so rebuilding does not grow the memory of the process. Only types without destructors may be stored.
+ * With hugePages the blocks are aligned to 2 MB and marked for transparent huge pages on Linux, which saves TLB misses
+ * during traversal. Other systems get normal pages.
+ */
+class Arena {
+public:
+	explicit Arena(bool hugePages = false) : hugePages(hugePages) {};
+	~Arena();
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+	Arena(Arena&& other);
+	Arena& operator=(Arena&& other);
+
+	void* allocate(size_t size, size_t alignment);
+	// forgets every allocation, the memory is handed out again by the next allocations
+	void reset();
+	// returns all memory to the system
+	void release();
+	bool usesHugePages() const { return hugePages; };
+	// bytes handed out since the last reset and bytes taken from the system
+	size_t used() const;
+	size_t reserved() const;
+
+	template <typename T>
+	ArenaArray<T> allocateArray(size_t count) {
+		static_assert(std::is_trivially_destructible<T>::value, "the arena never runs destructors");
+		ArenaArray<T> array;
+		if (count == 0)
+			return array;
+		array.items = static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+		array.count = count;
+		for (size_t i = 0; i < count; i++) {
+			new (array.items + i) T();
+		}
+		return array;
+	}
+
+	template <typename T>
+	ArenaArray<T> copyArray(const T* items, size_t count) {
+		ArenaArray<T> array = allocateArray<T>(count);
+		for (size_t i = 0; i < count; i++) {
+			array.items[i] = items[i];
+		}
+		return array;
+	}
+
+	// copies the array into room for capacity elements, the old memory stays allocated until the next reset
+	template <typename T>
+	ArenaArray<T> growArray(const ArenaArray<T>& array, size_t capacity) {
+		ArenaArray<T> grown = allocateArray<T>(capacity);
+		for (size_t i = 0; i < array.size(); i++) {
+			grown.items[i] = array.items[i];
+		}
+		grown.count = array.size();
+		return grown;
+	}
+
+private:
+	struct Block {
+		char* memory;
+		size_t size;
+	};
+	static const size_t BLOCK_SIZE = 2 * 1024 * 1024;
+	std::vector<Block> blocks;
+	size_t current = 0;	// block the next allocation is taken from
+	size_t offset = 0;	// first free byte of the current block
+	bool hugePages;
+
+	char* allocateBlock(size_t size);
+	void freeBlock(const Block& block);
+};
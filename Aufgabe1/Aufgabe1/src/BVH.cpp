@@ -0,0 +1,420 @@
+#include "BVH.h"
+#include <algorithm>
+#include <cfloat>
+
+namespace {
+	// subtrees over at least this many triangles are built as separate tasks
+	const uint32_t PARALLEL_TASK_SIZE = 4096;
+	// the traversal stack holds at most one node per level
+	const int MAX_DEPTH = 64;
+
+	float halfArea(const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+		glm::vec3 size = boundsMax - boundsMin;
+		return size.x * size.y + size.y * size.z + size.z * size.x;
+	}
+
+	BVHNode makeNode(const glm::vec3& boundsMin, const glm::vec3& boundsMax, uint32_t first, uint32_t count) {
+		BVHNode node;
+		for (int axis = 0; axis < 3; axis++) {
+			node.boundsMin[axis] = boundsMin[axis];
+			node.boundsMax[axis] = boundsMax[axis];
+		}
+		node.first = first;
+		node.count = count;
+		return node;
+	}
+
+	// distance at which the ray enters the bounds of the node, false if it misses them within [0, tmax]
+	bool enterNode(const BVHNode& node, const glm::vec3& origin, const glm::vec3& inverse, float tmax, float& entry) {
+		float tmin = 0.0f;
+		for (int axis = 0; axis < 3; axis++) {
+			float t0 = (node.boundsMin[axis] - origin[axis]) * inverse[axis];
+			float t1 = (node.boundsMax[axis] - origin[axis]) * inverse[axis];
+			if (t0 > t1)
+				std::swap(t0, t1);
+			tmin = std::max(tmin, t0);
+			tmax = std::min(tmax, t1);
+		}
+		entry = tmin;
+		return tmin <= tmax;
+	}
+}
+
+void BVH::build(Triangle* triangles, uint32_t count, float minVal, float maxVal, const BuildSettings& settings) {
+	this->settings = settings;
+	if (arena.usesHugePages() != settings.hugePages)
+		arena = Arena(settings.hugePages);
+	arena.reset();
+	nodes = ArenaArray<BVHNode>();
+	triangleIndices = ArenaArray<uint32_t>();
+	records = TriangleRecords();
+	boxes = ArenaArray<Box>();
+	boxesStored = false;
+	triangleData = triangles;
+	triangleCount = count;
+	sceneMin = minVal;
+	sceneMax = maxVal;
+
+	boundsMin = glm::vec3(FLT_MAX);
+	boundsMax = glm::vec3(-FLT_MAX);
+	triangleMin.resize(count);
+	triangleMax.resize(count);
+	centroids.resize(count);
+	order.resize(count);
+	for (uint32_t i = 0; i < count; i++) {
+		triangleMin[i] = triangleData[i].getMin();
+		triangleMax[i] = triangleData[i].getMax();
+		centroids[i] = (triangleMin[i] + triangleMax[i]) * 0.5f;
+		order[i] = i;
+		boundsMin = glm::min(boundsMin, triangleMin[i]);
+		boundsMax = glm::max(boundsMax, triangleMax[i]);
+	}
+
+	if (count > 0) {
+		ThreadPool buildPool(settings.threads);
+		pool = &buildPool;
+		BuildOutput out;
+		out.nodes.resize(1);
+		buildNode(0, 0, count, depthLimit(), out);
+		pool = nullptr;
+		nodes = arena.copyArray(out.nodes.data(), out.nodes.size());
+		triangleIndices = arena.copyArray(order.data(), order.size());
+		if (leafRecords) {
+			records.reserve(arena, triangleIndices.size());
+			records.fill(triangleData, triangleIndices.data(), 0, triangleIndices.size());
+		}
+	}
+
+	// the per triangle data is only needed by the build
+	std::vector<glm::vec3>().swap(triangleMin);
+	std::vector<glm::vec3>().swap(triangleMax);
+	std::vector<glm::vec3>().swap(centroids);
+	std::vector<uint32_t>().swap(order);
+
+	builtCost = totalCost();
+	degradation = 1.0f;
+}
+
+// builds the subtree over the triangles order[begin, end) into the node of the output
+void BVH::buildNode(uint32_t node, uint32_t begin, uint32_t end, int depth, BuildOutput& out) {
+	glm::vec3 nodeMin(FLT_MAX), nodeMax(-FLT_MAX);
+	glm::vec3 centroidMin(FLT_MAX), centroidMax(-FLT_MAX);
+	for (uint32_t i = begin; i < end; i++) {
+		uint32_t triangle = order[i];
+		nodeMin = glm::min(nodeMin, triangleMin[triangle]);
+		nodeMax = glm::max(nodeMax, triangleMax[triangle]);
+		centroidMin = glm::min(centroidMin, centroids[triangle]);
+		centroidMax = glm::max(centroidMax, centroids[triangle]);
+	}
+	uint32_t count = end - begin;
+	float area = halfArea(nodeMin, nodeMax);
+
+	int bestAxis = -1;
+	int bestBin = 0;
+	float bestCost = FLT_MAX;
+	int binCount = std::max(std::min(settings.bins, 4 * (int)count), 2);
+	if (count > (uint32_t)std::max(settings.maxLeafSize, 1) && depth > 0 && area > 0.0f) {
+		// every bin collects the bounds of the triangles whose centroid falls into it
+		// the sweeps from both sides then give the cost of every plane between two bins
+		std::vector<int> binCounts(binCount);
+		std::vector<glm::vec3> binMin(binCount), binMax(binCount);
+		std::vector<float> rightArea(binCount);
+		std::vector<int> rightCount(binCount);
+		for (int axis = 0; axis < 3; axis++) {
+			float extent = centroidMax[axis] - centroidMin[axis];
+			if (extent <= 0.0f)
+				continue;
+			float scale = binCount / extent;
+			std::fill(binCounts.begin(), binCounts.end(), 0);
+			std::fill(binMin.begin(), binMin.end(), glm::vec3(FLT_MAX));
+			std::fill(binMax.begin(), binMax.end(), glm::vec3(-FLT_MAX));
+			for (uint32_t i = begin; i < end; i++) {
+				uint32_t triangle = order[i];
+				int bin = std::min((int)((centroids[triangle][axis] - centroidMin[axis]) * scale), binCount - 1);
+				binCounts[bin]++;
+				binMin[bin] = glm::min(binMin[bin], triangleMin[triangle]);
+				binMax[bin] = glm::max(binMax[bin], triangleMax[triangle]);
+			}
+
+			glm::vec3 sweepMin(FLT_MAX), sweepMax(-FLT_MAX);
+			int sweepCount = 0;
+			for (int bin = binCount - 1; bin > 0; bin--) {
+				sweepMin = glm::min(sweepMin, binMin[bin]);
+				sweepMax = glm::max(sweepMax, binMax[bin]);
+				sweepCount += binCounts[bin];
+				rightArea[bin] = sweepCount > 0 ? halfArea(sweepMin, sweepMax) : 0.0f;
+				rightCount[bin] = sweepCount;
+			}
+			sweepMin = glm::vec3(FLT_MAX);
+			sweepMax = glm::vec3(-FLT_MAX);
+			sweepCount = 0;
+			// plane i lies between bin i - 1 and bin i
+			for (int bin = 1; bin < binCount; bin++) {
+				sweepMin = glm::min(sweepMin, binMin[bin - 1]);
+				sweepMax = glm::max(sweepMax, binMax[bin - 1]);
+				sweepCount += binCounts[bin - 1];
+				if (sweepCount == 0 || rightCount[bin] == 0)
+					continue;
+				float cost = settings.traversalCost + settings.intersectionCost * (halfArea(sweepMin, sweepMax) * sweepCount + rightArea[bin] * rightCount[bin]) / area;
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestBin = bin;
+				}
+			}
+		}
+	}
+
+	// the node becomes a leaf if no split is cheaper than testing every triangle
+	if (bestAxis < 0 || bestCost >= settings.intersectionCost * count) {
+		out.nodes[node] = makeNode(nodeMin, nodeMax, begin, count);
+		return;
+	}
+
+	float scale = binCount / (centroidMax[bestAxis] - centroidMin[bestAxis]);
+	uint32_t* middle = std::partition(order.data() + begin, order.data() + end, [&](uint32_t triangle) {
+		return std::min((int)((centroids[triangle][bestAxis] - centroidMin[bestAxis]) * scale), binCount - 1) < bestBin;
+	});
+	uint32_t split = (uint32_t)(middle - order.data());
+
+	uint32_t leftChild = (uint32_t)out.nodes.size();
+	out.nodes.resize(out.nodes.size() + 2);
+	out.nodes[node] = makeNode(nodeMin, nodeMax, leftChild, 0);
+	// both children work on their own range of the order, so another thread can build the left side meanwhile
+	splitChildren(out, leftChild, pool->size() > 1 && count >= PARALLEL_TASK_SIZE,
+		[&](uint32_t child, BuildOutput& childOut) { buildNode(child, begin, split, depth - 1, childOut); },
+		[&](uint32_t child, BuildOutput& childOut) { buildNode(child, split, end, depth - 1, childOut); });
+}
+
+// builds both children of a node, the right child always follows the left one
+// large subtrees are built by another thread into their own output, appending both in order afterwards
+// gives the same node array as a serial build
+void BVH::splitChildren(BuildOutput& out, uint32_t leftChild, bool parallel, const std::function<void(uint32_t, BuildOutput&)>& buildLeft, const std::function<void(uint32_t, BuildOutput&)>& buildRight) {
+	if (!parallel) {
+		buildLeft(leftChild, out);
+		buildRight(leftChild + 1, out);
+		return;
+	}
+
+	BuildOutput leftOut, rightOut;
+	leftOut.nodes.resize(1);
+	rightOut.nodes.resize(1);
+	ThreadPool::TaskGroup group;
+	pool->run(group, [&]() { buildLeft(0, leftOut); });
+	buildRight(0, rightOut);
+	pool->wait(group);
+	appendSubtree(out, leftChild, leftOut);
+	appendSubtree(out, leftChild + 1, rightOut);
+}
+
+// copies a subtree that was built into its own output, its root replaces the given node
+// the leaves already point into the shared order, so only the child indices move
+void BVH::appendSubtree(BuildOutput& out, uint32_t node, const BuildOutput& subtree) {
+	uint32_t nodeBase = (uint32_t)out.nodes.size() - 1;
+	for (size_t i = 0; i < subtree.nodes.size(); i++) {
+		BVHNode moved = subtree.nodes[i];
+		if (!moved.isLeaf())
+			moved.first += nodeBase;
+		if (i == 0)
+			out.nodes[node] = moved;
+		else
+			out.nodes.push_back(moved);
+	}
+}
+
+// children are always stored after their parent, so going through the nodes backwards fits every node after its children
+UpdateResult BVH::update(const std::vector<uint32_t>& changed) {
+	if (nodes.empty() || changed.empty())
+		return UpdateResult::Refit;
+
+	for (size_t i = nodes.size(); i-- > 0;) {
+		BVHNode& node = nodes[i];
+		glm::vec3 nodeMin(FLT_MAX), nodeMax(-FLT_MAX);
+		if (node.isLeaf()) {
+			for (uint32_t j = node.first; j < node.first + node.count; j++) {
+				const Triangle& triangle = triangleData[triangleIndices[j]];
+				nodeMin = glm::min(nodeMin, triangle.getMin());
+				nodeMax = glm::max(nodeMax, triangle.getMax());
+				if (leafRecords)
+					records.set(j, triangle);
+			}
+		}
+		else {
+			for (uint32_t child = node.first; child <= node.first + 1; child++) {
+				nodeMin = glm::min(nodeMin, glm::vec3(nodes[child].boundsMin[0], nodes[child].boundsMin[1], nodes[child].boundsMin[2]));
+				nodeMax = glm::max(nodeMax, glm::vec3(nodes[child].boundsMax[0], nodes[child].boundsMax[1], nodes[child].boundsMax[2]));
+			}
+		}
+		node = makeNode(nodeMin, nodeMax, node.first, node.count);
+	}
+	boundsMin = glm::vec3(nodes[0].boundsMin[0], nodes[0].boundsMin[1], nodes[0].boundsMin[2]);
+	boundsMax = glm::vec3(nodes[0].boundsMax[0], nodes[0].boundsMax[1], nodes[0].boundsMax[2]);
+
+	// the fitted bounds grow and overlap more with every move, at some point a new build is cheaper to traverse
+	float cost = totalCost();
+	if (cost > settings.rebuildThreshold * builtCost) {
+		build(triangleData, triangleCount, sceneMin, sceneMax, settings);
+		return UpdateResult::FullRebuild;
+	}
+	degradation = builtCost > 0.0f ? cost / builtCost : 1.0f;
+	boxesStored = false;
+	return UpdateResult::Refit;
+}
+
+// visits the nodes front to back and keeps the closest hit, nodes entered behind it are skipped
+Triangle* BVH::findHit(const float* point, const float* direction, float tmax, TriangleHit& hit, TraversalContext& context) const {
+	if (nodes.empty())
+		return nullptr;
+	glm::vec3 origin(point[0], point[1], point[2]);
+	glm::vec3 dir(direction[0], direction[1], direction[2]);
+	glm::vec3 inverse(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+	WatertightRay ray(origin, dir);
+
+	Triangle* result = nullptr;
+	TriangleHit resultHit;
+	float best = tmax;
+	float entry;
+	if (!enterNode(nodes[0], origin, inverse, best, entry))
+		return nullptr;
+
+	uint32_t* stack = context.node + context.base;
+	float* stackEntry = context.entry + context.base;
+	int stackSize = 0;
+	uint32_t node = 0;
+	while (true) {
+		const BVHNode& current = nodes[node];
+		if (current.isLeaf()) {
+			int found = intersectTriangles(ray, records, current.first, current.count, best, resultHit);
+			if (found >= 0) {
+				best = resultHit.t;
+				result = &triangleData[triangleIndices[current.first + found]];
+			}
+		}
+		else {
+			// the nearer child is visited first, the other one waits on the stack with its entry distance
+			uint32_t left = current.first;
+			uint32_t right = left + 1;
+			float leftEntry, rightEntry;
+			bool hitLeft = enterNode(nodes[left], origin, inverse, best, leftEntry);
+			bool hitRight = enterNode(nodes[right], origin, inverse, best, rightEntry);
+			if (hitLeft && hitRight) {
+				if (rightEntry < leftEntry) {
+					std::swap(left, right);
+					std::swap(leftEntry, rightEntry);
+				}
+				stack[stackSize] = right;
+				stackEntry[stackSize] = rightEntry;
+				stackSize++;
+				node = left;
+				continue;
+			}
+			if (hitLeft || hitRight) {
+				node = hitLeft ? left : right;
+				continue;
+			}
+		}
+
+		// a waiting node is only visited if the ray enters it before the closest hit so far
+		while (stackSize > 0 && stackEntry[stackSize - 1] > best) {
+			stackSize--;
+		}
+		if (stackSize == 0)
+			break;
+		stackSize--;
+		node = stack[stackSize];
+	}
+
+	if (result != nullptr)
+		hit = resultHit;
+	return result;
+}
+
+// depth first without any order, the first triangle hit within [0, tmax] ends the search
+bool BVH::occluded(const float* point, const float* direction, float tmax, TraversalContext& context) const {
+	if (nodes.empty())
+		return false;
+	glm::vec3 origin(point[0], point[1], point[2]);
+	glm::vec3 dir(direction[0], direction[1], direction[2]);
+	glm::vec3 inverse(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+	WatertightRay ray(origin, dir);
+
+	uint32_t* stack = context.node + context.base;
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+	while (stackSize > 0) {
+		const BVHNode& current = nodes[stack[--stackSize]];
+		float entry;
+		if (!enterNode(current, origin, inverse, tmax, entry))
+			continue;
+		if (!current.isLeaf()) {
+			stack[stackSize++] = current.first + 1;
+			stack[stackSize++] = current.first;
+			continue;
+		}
+		TriangleHit hit;
+		if (intersectTriangles(ray, records, current.first, current.count, tmax, hit) >= 0)
+			return true;
+	}
+	return false;
+}
+
+// SAH cost of the hierarchy, every node is weighted with its surface area
+float BVH::totalCost() const {
+	float cost = 0.0f;
+	for (const BVHNode& node : nodes) {
+		float area = halfArea(glm::vec3(node.boundsMin[0], node.boundsMin[1], node.boundsMin[2]), glm::vec3(node.boundsMax[0], node.boundsMax[1], node.boundsMax[2]));
+		cost += area * (node.isLeaf() ? settings.intersectionCost * node.count : settings.traversalCost);
+	}
+	return cost;
+}
+
+// expected cost of a ray through the scene, comparable with KDTree::expectedCost
+float BVH::expectedCost() const {
+	float area = halfArea(boundsMin, boundsMax);
+	if (nodes.empty() || area <= 0.0f)
+		return 0.0f;
+	return totalCost() / area;
+}
+
+AccelerationStats BVH::stats() const {
+	AccelerationStats result;
+	result.nodes = nodes.size();
+	result.bytes = nodes.size() * sizeof(BVHNode) + triangleIndices.size() * sizeof(uint32_t) + records.bytes();
+	result.expectedCost = expectedCost();
+	if (nodes.empty())
+		return result;
+	std::vector<std::pair<uint32_t, int>> stack(1, std::make_pair(0u, 0));
+	while (!stack.empty()) {
+		uint32_t node = stack.back().first;
+		int level = stack.back().second;
+		stack.pop_back();
+		const BVHNode& current = nodes[node];
+		if (current.isLeaf()) {
+			result.leaves++;
+			result.references += current.count;
+			result.depth = std::max(result.depth, level);
+		}
+		else {
+			stack.push_back(std::make_pair(current.first + 1, level + 1));
+			stack.push_back(std::make_pair(current.first, level + 1));
+		}
+	}
+	return result;
+}
+
+// deepest level the build may create, the traversal stack is sized for it
+int BVH::depthLimit() const {
+	if (settings.maxDepth > 0)
+		return std::min(settings.maxDepth, MAX_DEPTH - 1);
+	return MAX_DEPTH - 1;
+}
+
+// the boxes are the bounds of the nodes, an update refits them in place
+void BVH::storeBoxes() {
+	if (boxes.size() != nodes.size())
+		boxes = arena.allocateArray<Box>(nodes.size());
+	for (size_t i = 0; i < nodes.size(); i++) {
+		const BVHNode& node = nodes[i];
+		boxes[i] = Box(node.boundsMin[0], node.boundsMax[0], node.boundsMin[1], node.boundsMax[1], node.boundsMin[2], node.boundsMax[2]);
+	}
+}
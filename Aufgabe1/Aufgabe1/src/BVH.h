@@ -0,0 +1,64 @@
+#pragma once
+#include "AccelerationStructure.h"
+#include "ThreadPool.h"
+#include "Arena.h"
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// node of the flattened hierarchy, two of them fit into a cache line
+// interior nodes have a count of 0 and keep the index of their left child in first, the right child always follows it
+// leaves reference count triangles of the index list starting at first
+struct BVHNode {
+	float boundsMin[3];
+	uint32_t first;
+	float boundsMax[3];
+	uint32_t count;
+
+	bool isLeaf() const { return count > 0; };
+};
+
+static_assert(sizeof(BVHNode) == 32, "nodes have to stay 32 bytes to keep two of them in a cache line");
+
+/**
+ * Bounding volume hierarchy over the triangles of the scene.
+ * Unlike the KD-tree it partitions the triangles instead of the space: every triangle is referenced by exactly one leaf,
+ * so the memory is bounded by the triangle count, but the bounds of siblings may overlap and a ray may have to visit both.
+ * The build sorts the triangle centroids of a node into bins and splits where the surface area heuristic is lowest.
+ */
+class BVH : public AccelerationStructure {
+	// nodes of a (sub)tree, subtrees built by other threads are appended to the parent's output afterwards
+	struct BuildOutput {
+		std::vector<BVHNode> nodes;
+	};
+	// bounds and centroid of every triangle, only kept during the build
+	std::vector<glm::vec3> triangleMin, triangleMax, centroids;
+	std::vector<uint32_t> order;	// triangle indices, the build partitions them in place and the leaves are ranges of them
+	ThreadPool* pool = nullptr;	// only set while building
+	float builtCost = 0.0f;		// SAH cost right after the last build, updates compare against it
+	float sceneMin = 0.0f, sceneMax = 0.0f;
+
+	void buildNode(uint32_t node, uint32_t begin, uint32_t end, int depth, BuildOutput& out);
+	void splitChildren(BuildOutput& out, uint32_t leftChild, bool parallel, const std::function<void(uint32_t, BuildOutput&)>& buildLeft, const std::function<void(uint32_t, BuildOutput&)>& buildRight);
+	static void appendSubtree(BuildOutput& out, uint32_t node, const BuildOutput& subtree);
+	float totalCost() const;
+	int depthLimit() const;
+	void storeBoxes() override;
+public:
+	Arena arena;						// owns the nodes, the leaf lists and the boxes of the current build
+	ArenaArray<BVHNode> nodes;			// the flattened hierarchy, the root is the first node
+	ArenaArray<uint32_t> triangleIndices;	// triangle lists of the leaves
+	TriangleRecords records;			// corners of the triangles in the order of triangleIndices, the only triangle data a query reads
+	bool leafRecords = true;			// false leaves the records empty, for an owner that tests the referenced triangles itself
+	BVH() {};
+	using AccelerationStructure::build;
+	using AccelerationStructure::update;
+	void build(Triangle* triangles, uint32_t count, float minVal, float maxVal, const BuildSettings& settings) override;
+	// the bounds of the nodes are fitted to the moved triangles, the hierarchy is rebuilt if its cost grew too much
+	UpdateResult update(const std::vector<uint32_t>& changed) override;
+	Triangle* findHit(const float* point, const float* direction, float tmax, TriangleHit& hit, TraversalContext& context) const override;
+	bool occluded(const float* point, const float* direction, float tmax, TraversalContext& context) const override;
+	AccelerationStats stats() const override;
+	float expectedCost() const;
+};
@@ -4,7 +4,7 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
-#include <vector>
+#include <array>
 class Box {
 public:
     static constexpr float points[48] = {
@@ -36,17 +36,17 @@ public:
 		this->zMax = zMax;
 	}
 
-	std::vector<glm::vec3> getCorners() {
-		std::vector<glm::vec3>* toReturn = new std::vector<glm::vec3>(8);
-		toReturn->at(0) = *(new glm::vec3(xMin, yMin, zMin));
-		toReturn->at(1) = *(new glm::vec3(xMin, yMax, zMin));
-		toReturn->at(2) = *(new glm::vec3(xMin, yMin, zMax));
-		toReturn->at(3) = *(new glm::vec3(xMin, yMax, zMax));
-		toReturn->at(4) = *(new glm::vec3(xMax, yMin, zMin));
-		toReturn->at(5) = *(new glm::vec3(xMax, yMax, zMin));
-		toReturn->at(6) = *(new glm::vec3(xMax, yMin, zMax));
-		toReturn->at(7) = *(new glm::vec3(xMax, yMax, zMax));
-		return *toReturn;
+	std::array<glm::vec3, 8> getCorners() const {
+		return { {
+			glm::vec3(xMin, yMin, zMin),
+			glm::vec3(xMin, yMax, zMin),
+			glm::vec3(xMin, yMin, zMax),
+			glm::vec3(xMin, yMax, zMax),
+			glm::vec3(xMax, yMin, zMin),
+			glm::vec3(xMax, yMax, zMin),
+			glm::vec3(xMax, yMin, zMax),
+			glm::vec3(xMax, yMax, zMax)
+		} };
 	}
 
     glm::mat4 getTransformMatrix(glm::mat4& model) {
@@ -0,0 +1,210 @@
+#include "InstancedBVH.h"
+#include <algorithm>
+#include <cfloat>
+
+namespace {
+	// the traversal stack holds at most one node per level
+	const int MAX_DEPTH = 64;
+
+	// distance at which the ray enters the bounds of the node, false if it misses them within [0, tmax]
+	bool enterNode(const BVHNode& node, const glm::vec3& origin, const glm::vec3& inverse, float tmax, float& entry) {
+		float tmin = 0.0f;
+		for (int axis = 0; axis < 3; axis++) {
+			float t0 = (node.boundsMin[axis] - origin[axis]) * inverse[axis];
+			float t1 = (node.boundsMax[axis] - origin[axis]) * inverse[axis];
+			if (t0 > t1)
+				std::swap(t0, t1);
+			tmin = std::max(tmin, t0);
+			tmax = std::min(tmax, t1);
+		}
+		entry = tmin;
+		return tmin <= tmax;
+	}
+
+	// true if both settings give the same BVH, the thread count doesn't change it and the mesh is never updated
+	bool sameMeshSettings(const BuildSettings& first, const BuildSettings& second) {
+		return first.traversalCost == second.traversalCost && first.intersectionCost == second.intersectionCost
+			&& first.bins == second.bins && first.maxLeafSize == second.maxLeafSize && first.maxDepth == second.maxDepth
+			&& first.hugePages == second.hugePages;
+	}
+}
+
+void InstanceTransform::set(const glm::mat4& modelMatrix) {
+	// glm matrices are stored by column, the rows of the inverse are gathered from its transpose
+	glm::mat4 inverse = glm::transpose(glm::inverse(modelMatrix));
+	for (int row = 0; row < 3; row++) {
+		rows[row] = inverse[row];
+	}
+}
+
+void InstancedBVH::build(Triangle* triangles, uint32_t count, float minVal, float maxVal, const BuildSettings& settings) {
+	this->settings = settings;
+	if (arena.usesHugePages() != settings.hugePages)
+		arena = Arena(settings.hugePages);
+	arena.reset();
+	triangleData = triangles;
+	triangleCount = count;
+
+	// the canonical mesh is built once, later builds only replace the instances unless their settings shape it differently
+	if (meshTriangles.empty() || !sameMeshSettings(meshSettings, settings)) {
+		if (meshTriangles.empty())
+			meshTriangles.push_back(Triangle(glm::mat4(1.0f)));
+		mesh.build(meshTriangles, -1.0f, 1.0f, settings);
+		meshSettings = settings;
+	}
+
+	top.leafRecords = false;
+	top.build(triangles, count, minVal, maxVal, settings);
+	transforms = arena.allocateArray<InstanceTransform>(count);
+	for (uint32_t i = 0; i < count; i++) {
+		transforms[i].set(triangleData[i].getModelMat());
+	}
+	boundsMin = top.boundsMin;
+	boundsMax = top.boundsMax;
+	boxesStored = false;
+	degradation = top.degradation;
+}
+
+UpdateResult InstancedBVH::update(const std::vector<uint32_t>& changed) {
+	UpdateResult result = top.update(changed);
+	for (uint32_t instance : changed) {
+		transforms[instance].set(triangleData[instance].getModelMat());
+	}
+	boundsMin = top.boundsMin;
+	boundsMax = top.boundsMax;
+	boxesStored = false;
+	degradation = top.degradation;
+	return result;
+}
+
+// moves the ray into the coordinates of the mesh and returns the instance if the ray hits the mesh there
+// the mesh is traversed with the part of the context above the stack of the top level
+Triangle* InstancedBVH::hitInstance(uint32_t instance, const glm::vec3& origin, const glm::vec3& dir, float tmax, TriangleHit& hit, TraversalContext& context) const {
+	const InstanceTransform& transform = transforms[instance];
+	glm::vec3 meshOrigin = transform.point(origin);
+	glm::vec3 meshDir = transform.vector(dir);
+	context.base += MAX_DEPTH;
+	Triangle* found = mesh.findHit(&meshOrigin.x, &meshDir.x, tmax, hit, context);
+	context.base -= MAX_DEPTH;
+	if (found == nullptr)
+		return nullptr;
+	return &triangleData[instance];
+}
+
+// the traversal of BVH::findHit over the top level, the leaves trace the ray through their instances
+Triangle* InstancedBVH::findHit(const float* point, const float* direction, float tmax, TriangleHit& hit, TraversalContext& context) const {
+	const ArenaArray<BVHNode>& nodes = top.nodes;
+	if (nodes.empty())
+		return nullptr;
+	glm::vec3 origin(point[0], point[1], point[2]);
+	glm::vec3 dir(direction[0], direction[1], direction[2]);
+	glm::vec3 inverse(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+
+	Triangle* result = nullptr;
+	TriangleHit resultHit;
+	float best = tmax;
+	float entry;
+	if (!enterNode(nodes[0], origin, inverse, best, entry))
+		return nullptr;
+
+	uint32_t* stack = context.node + context.base;
+	float* stackEntry = context.entry + context.base;
+	int stackSize = 0;
+	uint32_t node = 0;
+	while (true) {
+		const BVHNode& current = nodes[node];
+		if (current.isLeaf()) {
+			for (uint32_t i = current.first; i < current.first + current.count; i++) {
+				Triangle* found = hitInstance(top.triangleIndices[i], origin, dir, best, resultHit, context);
+				if (found != nullptr) {
+					best = resultHit.t;
+					result = found;
+				}
+			}
+		}
+		else {
+			uint32_t left = current.first;
+			uint32_t right = left + 1;
+			float leftEntry, rightEntry;
+			bool hitLeft = enterNode(nodes[left], origin, inverse, best, leftEntry);
+			bool hitRight = enterNode(nodes[right], origin, inverse, best, rightEntry);
+			if (hitLeft && hitRight) {
+				if (rightEntry < leftEntry) {
+					std::swap(left, right);
+					std::swap(leftEntry, rightEntry);
+				}
+				stack[stackSize] = right;
+				stackEntry[stackSize] = rightEntry;
+				stackSize++;
+				node = left;
+				continue;
+			}
+			if (hitLeft || hitRight) {
+				node = hitLeft ? left : right;
+				continue;
+			}
+		}
+
+		while (stackSize > 0 && stackEntry[stackSize - 1] > best) {
+			stackSize--;
+		}
+		if (stackSize == 0)
+			break;
+		stackSize--;
+		node = stack[stackSize];
+	}
+
+	if (result != nullptr)
+		hit = resultHit;
+	return result;
+}
+
+// depth first without any order, the first instance the ray hits within [0, tmax] ends the search
+bool InstancedBVH::occluded(const float* point, const float* direction, float tmax, TraversalContext& context) const {
+	const ArenaArray<BVHNode>& nodes = top.nodes;
+	if (nodes.empty())
+		return false;
+	glm::vec3 origin(point[0], point[1], point[2]);
+	glm::vec3 dir(direction[0], direction[1], direction[2]);
+	glm::vec3 inverse(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+
+	uint32_t* stack = context.node + context.base;
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+	while (stackSize > 0) {
+		const BVHNode& current = nodes[stack[--stackSize]];
+		float entry;
+		if (!enterNode(current, origin, inverse, tmax, entry))
+			continue;
+		if (!current.isLeaf()) {
+			stack[stackSize++] = current.first + 1;
+			stack[stackSize++] = current.first;
+			continue;
+		}
+		for (uint32_t i = current.first; i < current.first + current.count; i++) {
+			const InstanceTransform& transform = transforms[top.triangleIndices[i]];
+			glm::vec3 meshOrigin = transform.point(origin);
+			glm::vec3 meshDir = transform.vector(dir);
+			context.base += MAX_DEPTH;
+			bool hit = mesh.occluded(&meshOrigin.x, &meshDir.x, tmax, context);
+			context.base -= MAX_DEPTH;
+			if (hit)
+				return true;
+		}
+	}
+	return false;
+}
+
+// the boxes of the top level, the mesh is too small to be worth drawing
+void InstancedBVH::storeBoxes() {
+	boxes = top.nodeBoxes();
+}
+
+// the top level counts like a BVH over the instances, the mesh and the matrices are added to its memory
+AccelerationStats InstancedBVH::stats() const {
+	AccelerationStats result = top.stats();
+	AccelerationStats meshStats = mesh.stats();
+	result.nodes += meshStats.nodes;
+	result.bytes += meshStats.bytes + meshTriangles.size() * sizeof(Triangle) + transforms.size() * sizeof(InstanceTransform);
+	return result;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "BVH.h"
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// inverse of the model matrix of an instance, it moves points and directions from the scene into the coordinates of the mesh
+// only the upper three rows are kept, the last row of an affine matrix is always (0, 0, 0, 1)
+struct InstanceTransform {
+	glm::vec4 rows[3];
+
+	void set(const glm::mat4& modelMatrix);
+	glm::vec3 point(const glm::vec3& p) const {
+		return glm::vec3(glm::dot(rows[0], glm::vec4(p, 1.0f)), glm::dot(rows[1], glm::vec4(p, 1.0f)), glm::dot(rows[2], glm::vec4(p, 1.0f)));
+	};
+	glm::vec3 vector(const glm::vec3& v) const {
+		return glm::vec3(glm::dot(glm::vec3(rows[0]), v), glm::dot(glm::vec3(rows[1]), v), glm::dot(glm::vec3(rows[2]), v));
+	};
+};
+
+/**
+ * Two level hierarchy that stores the triangles of a mesh once in the coordinates of the mesh, however often the scene places it.
+ * The top level is a BVH over the bounds of the instances, its leaves reference instances instead of triangles.
+ * A ray reaching an instance is moved into the coordinates of its mesh with the cached inverse model matrix and traced
+ * through the bottom level BVH of the mesh. The transformation is affine and the direction is not normalised,
+ * so the distance and the barycentric coordinates of a hit are the same in both coordinate systems.
+ * Every Triangle of the scene is an instance of the canonical mesh Triangle::positions, which is the only bottom level.
+ * The memory grows with the instances and the distinct meshes, no corners are stored per instance.
+ * The watertight triangle test only holds within a mesh, neighbouring instances are tested in different coordinates.
+ */
+class InstancedBVH : public AccelerationStructure {
+	std::vector<Triangle> meshTriangles;	// the canonical mesh in its own coordinates
+	BuildSettings meshSettings;				// settings the mesh was built with
+
+	Triangle* hitInstance(uint32_t instance, const glm::vec3& origin, const glm::vec3& dir, float tmax, TriangleHit& hit, TraversalContext& context) const;
+	void storeBoxes() override;
+public:
+	Arena arena;						// owns the inverse matrices
+	BVH top;							// hierarchy over the bounds of the instances, without triangle records
+	BVH mesh;							// bottom level over the triangles of the canonical mesh
+	ArenaArray<InstanceTransform> transforms;	// inverse model matrix of every instance, in the order of the triangles
+	InstancedBVH() {};
+	using AccelerationStructure::build;
+	using AccelerationStructure::update;
+	void build(Triangle* triangles, uint32_t count, float minVal, float maxVal, const BuildSettings& settings) override;
+	// the top level is refitted or rebuilt like a BVH and the moved instances get new inverse matrices, the mesh stays as it is
+	UpdateResult update(const std::vector<uint32_t>& changed) override;
+	Triangle* findHit(const float* point, const float* direction, float tmax, TriangleHit& hit, TraversalContext& context) const override;
+	bool occluded(const float* point, const float* direction, float tmax, TraversalContext& context) const override;
+	AccelerationStats stats() const override;
+};
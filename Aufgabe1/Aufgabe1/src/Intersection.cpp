@@ -0,0 +1,248 @@
+#include "Intersection.h"
+#include "Simd.h"
+#include <algorithm>
+#include <cmath>
+
+WatertightRay::WatertightRay(const glm::vec3& origin, const glm::vec3& direction) : origin(origin) {
+	glm::vec3 size = glm::abs(direction);
+	kz = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+	kx = (kz + 1) % 3;
+	ky = (kx + 1) % 3;
+	// looking down a negative axis mirrors the projection, swapping kx and ky mirrors it back
+	if (direction[kz] < 0.0f)
+		std::swap(kx, ky);
+	sx = direction[kx] / direction[kz];
+	sy = direction[ky] / direction[kz];
+	sz = 1.0f / direction[kz];
+}
+
+bool intersectTriangle(const WatertightRay& ray, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c, float tmax, TriangleHit& hit) {
+	// corners relative to the origin, sheared so the ray runs along kz
+	glm::vec3 relativeA = a - ray.origin;
+	glm::vec3 relativeB = b - ray.origin;
+	glm::vec3 relativeC = c - ray.origin;
+	float ax = relativeA[ray.kx] - ray.sx * relativeA[ray.kz];
+	float ay = relativeA[ray.ky] - ray.sy * relativeA[ray.kz];
+	float bx = relativeB[ray.kx] - ray.sx * relativeB[ray.kz];
+	float by = relativeB[ray.ky] - ray.sy * relativeB[ray.kz];
+	float cx = relativeC[ray.kx] - ray.sx * relativeC[ray.kz];
+	float cy = relativeC[ray.ky] - ray.sy * relativeC[ray.kz];
+
+	// edge functions opposite of each corner, the scaled barycentric coordinates of the point the ray passes
+	float edgeA = cx * by - cy * bx;
+	float edgeB = ax * cy - ay * cx;
+	float edgeC = bx * ay - by * ax;
+	// a value of exactly 0 may have lost its sign to rounding, the products are exact in double
+	if (edgeA == 0.0f || edgeB == 0.0f || edgeC == 0.0f) {
+		edgeA = (float)((double)cx * (double)by - (double)cy * (double)bx);
+		edgeB = (float)((double)ax * (double)cy - (double)ay * (double)cx);
+		edgeC = (float)((double)bx * (double)ay - (double)by * (double)ax);
+	}
+	// the ray passes inside if no edge function disagrees with the others, either winding of the corners is hit
+	if ((edgeA < 0.0f || edgeB < 0.0f || edgeC < 0.0f) && (edgeA > 0.0f || edgeB > 0.0f || edgeC > 0.0f))
+		return false;
+	float determinant = edgeA + edgeB + edgeC;
+	// the ray lies in the plane of the triangle
+	if (determinant == 0.0f)
+		return false;
+
+	float az = ray.sz * relativeA[ray.kz];
+	float bz = ray.sz * relativeB[ray.kz];
+	float cz = ray.sz * relativeC[ray.kz];
+	float t = (edgeA * az + edgeB * bz + edgeC * cz) / determinant;
+	if (!(t >= 0.0f && t <= tmax))
+		return false;
+	hit.t = t;
+	hit.u = edgeB / determinant;
+	hit.v = edgeC / determinant;
+	return true;
+}
+
+namespace {
+	// picks the closest hit among the lanes of a SIMD test, in lane order so ties go to the first triangle like in a scalar loop
+	// degenerate lanes have an edge function of 0 and are tested again with the scalar test, which resolves the sign
+	int closestLane(const WatertightRay& ray, const TriangleRecords& records, size_t first, int count, float tmax, int hits, int degenerate,
+		const float* t, const float* edgeB, const float* edgeC, const float* determinant, TriangleHit& hit) {
+		int result = -1;
+		for (int lane = 0; lane < count; lane++) {
+			if (degenerate & (1 << lane)) {
+				TriangleHit candidate;
+				if (intersectTriangle(ray, records, first + lane, tmax, candidate) && (result < 0 || candidate.t < hit.t)) {
+					hit = candidate;
+					result = lane;
+				}
+			}
+			else if ((hits & (1 << lane)) && (result < 0 || t[lane] < hit.t)) {
+				hit.t = t[lane];
+				hit.u = edgeB[lane] / determinant[lane];
+				hit.v = edgeC[lane] / determinant[lane];
+				result = lane;
+			}
+		}
+		return result;
+	}
+}
+
+// the SIMD tests repeat the steps of intersectTriangle on every lane with the same operations in the same order,
+// which gives bit for bit the same results
+template <>
+int intersectPack<4>(const WatertightRay& ray, const TriangleRecords& records, size_t first, int count, float tmax, TriangleHit& hit, int skipped) {
+#if KDTREE_SSE
+	const __m128 zero = _mm_setzero_ps();
+	__m128 originX = _mm_set1_ps(ray.origin[ray.kx]);
+	__m128 originY = _mm_set1_ps(ray.origin[ray.ky]);
+	__m128 originZ = _mm_set1_ps(ray.origin[ray.kz]);
+	__m128 shearX = _mm_set1_ps(ray.sx);
+	__m128 shearY = _mm_set1_ps(ray.sy);
+	__m128 shearZ = _mm_set1_ps(ray.sz);
+
+	__m128 x[3], y[3], z[3];
+	for (int corner = 0; corner < 3; corner++) {
+		__m128 relativeX = _mm_sub_ps(_mm_loadu_ps(&records.corners[corner][ray.kx][first]), originX);
+		__m128 relativeY = _mm_sub_ps(_mm_loadu_ps(&records.corners[corner][ray.ky][first]), originY);
+		__m128 relativeZ = _mm_sub_ps(_mm_loadu_ps(&records.corners[corner][ray.kz][first]), originZ);
+		x[corner] = _mm_sub_ps(relativeX, _mm_mul_ps(shearX, relativeZ));
+		y[corner] = _mm_sub_ps(relativeY, _mm_mul_ps(shearY, relativeZ));
+		z[corner] = _mm_mul_ps(shearZ, relativeZ);
+	}
+	__m128 edgeA = _mm_sub_ps(_mm_mul_ps(x[2], y[1]), _mm_mul_ps(y[2], x[1]));
+	__m128 edgeB = _mm_sub_ps(_mm_mul_ps(x[0], y[2]), _mm_mul_ps(y[0], x[2]));
+	__m128 edgeC = _mm_sub_ps(_mm_mul_ps(x[1], y[0]), _mm_mul_ps(y[1], x[0]));
+	int degenerate = _mm_movemask_ps(_mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(edgeA, zero), _mm_cmpeq_ps(edgeB, zero)), _mm_cmpeq_ps(edgeC, zero)));
+
+	__m128 negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(edgeA, zero), _mm_cmplt_ps(edgeB, zero)), _mm_cmplt_ps(edgeC, zero));
+	__m128 positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(edgeA, zero), _mm_cmpgt_ps(edgeB, zero)), _mm_cmpgt_ps(edgeC, zero));
+	__m128 determinant = _mm_add_ps(_mm_add_ps(edgeA, edgeB), edgeC);
+	__m128 t = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(edgeA, z[0]), _mm_mul_ps(edgeB, z[1])), _mm_mul_ps(edgeC, z[2])), determinant);
+	__m128 valid = _mm_andnot_ps(_mm_and_ps(negative, positive), _mm_cmpneq_ps(determinant, zero));
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(t, zero), _mm_cmple_ps(t, _mm_set1_ps(tmax))));
+	// lanes past count hold no triangle
+	int lanes = ((1 << count) - 1) & ~skipped;
+	degenerate &= lanes;
+	int hits = _mm_movemask_ps(valid) & ~degenerate & lanes;
+	if ((hits | degenerate) == 0)
+		return -1;
+
+	alignas(16) float tValues[4], edgeBValues[4], edgeCValues[4], determinantValues[4];
+	_mm_store_ps(tValues, t);
+	_mm_store_ps(edgeBValues, edgeB);
+	_mm_store_ps(edgeCValues, edgeC);
+	_mm_store_ps(determinantValues, determinant);
+	return closestLane(ray, records, first, count, tmax, hits, degenerate, tValues, edgeBValues, edgeCValues, determinantValues, hit);
+#else
+	return closestLane(ray, records, first, count, tmax, 0, ((1 << count) - 1) & ~skipped, nullptr, nullptr, nullptr, nullptr, hit);
+#endif
+}
+
+template <>
+int intersectPack<8>(const WatertightRay& ray, const TriangleRecords& records, size_t first, int count, float tmax, TriangleHit& hit, int skipped) {
+#if KDTREE_AVX
+	const __m256 zero = _mm256_setzero_ps();
+	__m256 originX = _mm256_set1_ps(ray.origin[ray.kx]);
+	__m256 originY = _mm256_set1_ps(ray.origin[ray.ky]);
+	__m256 originZ = _mm256_set1_ps(ray.origin[ray.kz]);
+	__m256 shearX = _mm256_set1_ps(ray.sx);
+	__m256 shearY = _mm256_set1_ps(ray.sy);
+	__m256 shearZ = _mm256_set1_ps(ray.sz);
+
+	__m256 x[3], y[3], z[3];
+	for (int corner = 0; corner < 3; corner++) {
+		__m256 relativeX = _mm256_sub_ps(_mm256_loadu_ps(&records.corners[corner][ray.kx][first]), originX);
+		__m256 relativeY = _mm256_sub_ps(_mm256_loadu_ps(&records.corners[corner][ray.ky][first]), originY);
+		__m256 relativeZ = _mm256_sub_ps(_mm256_loadu_ps(&records.corners[corner][ray.kz][first]), originZ);
+		x[corner] = _mm256_sub_ps(relativeX, _mm256_mul_ps(shearX, relativeZ));
+		y[corner] = _mm256_sub_ps(relativeY, _mm256_mul_ps(shearY, relativeZ));
+		z[corner] = _mm256_mul_ps(shearZ, relativeZ);
+	}
+	__m256 edgeA = _mm256_sub_ps(_mm256_mul_ps(x[2], y[1]), _mm256_mul_ps(y[2], x[1]));
+	__m256 edgeB = _mm256_sub_ps(_mm256_mul_ps(x[0], y[2]), _mm256_mul_ps(y[0], x[2]));
+	__m256 edgeC = _mm256_sub_ps(_mm256_mul_ps(x[1], y[0]), _mm256_mul_ps(y[1], x[0]));
+	int degenerate = _mm256_movemask_ps(_mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(edgeA, zero, _CMP_EQ_OQ), _mm256_cmp_ps(edgeB, zero, _CMP_EQ_OQ)),
+		_mm256_cmp_ps(edgeC, zero, _CMP_EQ_OQ)));
+
+	__m256 negative = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(edgeA, zero, _CMP_LT_OQ), _mm256_cmp_ps(edgeB, zero, _CMP_LT_OQ)), _mm256_cmp_ps(edgeC, zero, _CMP_LT_OQ));
+	__m256 positive = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(edgeA, zero, _CMP_GT_OQ), _mm256_cmp_ps(edgeB, zero, _CMP_GT_OQ)), _mm256_cmp_ps(edgeC, zero, _CMP_GT_OQ));
+	__m256 determinant = _mm256_add_ps(_mm256_add_ps(edgeA, edgeB), edgeC);
+	__m256 t = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(edgeA, z[0]), _mm256_mul_ps(edgeB, z[1])), _mm256_mul_ps(edgeC, z[2])), determinant);
+	__m256 valid = _mm256_andnot_ps(_mm256_and_ps(negative, positive), _mm256_cmp_ps(determinant, zero, _CMP_NEQ_UQ));
+	valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, zero, _CMP_GE_OQ), _mm256_cmp_ps(t, _mm256_set1_ps(tmax), _CMP_LE_OQ)));
+	// lanes past count hold no triangle
+	int lanes = ((1 << count) - 1) & ~skipped;
+	degenerate &= lanes;
+	int hits = _mm256_movemask_ps(valid) & ~degenerate & lanes;
+	if ((hits | degenerate) == 0)
+		return -1;
+
+	alignas(32) float tValues[8], edgeBValues[8], edgeCValues[8], determinantValues[8];
+	_mm256_store_ps(tValues, t);
+	_mm256_store_ps(edgeBValues, edgeB);
+	_mm256_store_ps(edgeCValues, edgeC);
+	_mm256_store_ps(determinantValues, determinant);
+	return closestLane(ray, records, first, count, tmax, hits, degenerate, tValues, edgeBValues, edgeCValues, determinantValues, hit);
+#else
+	return closestLane(ray, records, first, count, tmax, 0, ((1 << count) - 1) & ~skipped, nullptr, nullptr, nullptr, nullptr, hit);
+#endif
+}
+
+namespace {
+	// intersectPack over count references, skipped(offset, width) gives the lanes of a pack to leave out
+	template <typename Skipped>
+	int intersectPacks(const WatertightRay& ray, const TriangleRecords& records, size_t first, uint32_t count, float tmax, TriangleHit& hit, Skipped skipped) {
+		int result = -1;
+		uint32_t offset = 0;
+#if KDTREE_AVX
+		// 8 lanes are only worth it for more than 4 triangles, the rest is left to the 4 wide test
+		for (; offset + 4 < count; offset += 8) {
+			int width = (int)std::min<uint32_t>(8, count - offset);
+			int mask = skipped(offset, width);
+			if (mask == (1 << width) - 1)
+				continue;
+			int lane = intersectPack<8>(ray, records, first + offset, width, tmax, hit, mask);
+			if (lane >= 0) {
+				tmax = hit.t;
+				result = (int)offset + lane;
+			}
+		}
+#endif
+		for (; offset < count; offset += 4) {
+			int width = (int)std::min<uint32_t>(4, count - offset);
+			int mask = skipped(offset, width);
+			if (mask == (1 << width) - 1)
+				continue;
+			int lane = intersectPack<4>(ray, records, first + offset, width, tmax, hit, mask);
+			if (lane >= 0) {
+				tmax = hit.t;
+				result = (int)offset + lane;
+			}
+		}
+		return result;
+	}
+}
+
+int intersectTriangles(const WatertightRay& ray, const TriangleRecords& records, size_t first, uint32_t count, float tmax, TriangleHit& hit) {
+	return intersectPacks(ray, records, first, count, tmax, hit, [](uint32_t, int) { return 0; });
+}
+
+int intersectTriangles(const WatertightRay& ray, const TriangleRecords& records, const uint32_t* indices, size_t first, uint32_t count, Mailbox& mailbox, float tmax, TriangleHit& hit) {
+	return intersectPacks(ray, records, first, count, tmax, hit, [&](uint32_t offset, int width) {
+		int mask = 0;
+		for (int lane = 0; lane < width; lane++) {
+			if (!mailbox.check(indices[first + offset + lane]))
+				mask |= 1 << lane;
+		}
+		return mask;
+	});
+}
+
+// the padding is allocated as part of the arrays, so the entries past the references are zero and safe to load
+void TriangleRecords::reserve(Arena& arena, size_t capacity) {
+	if (corners[0][0].size() >= capacity + PADDING)
+		return;
+	for (int corner = 0; corner < 3; corner++) {
+		for (int axis = 0; axis < 3; axis++) {
+			ArenaArray<float>& values = corners[corner][axis];
+			values = arena.growArray(values, capacity + PADDING);
+			values.count = capacity + PADDING;
+		}
+	}
+}
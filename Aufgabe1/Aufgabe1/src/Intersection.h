@@ -0,0 +1,100 @@
+#pragma once
+#include "Triangle.h"
+#include "Arena.h"
+#include <glm/glm.hpp>
+#include <cstdint>
+
+// ray prepared for the watertight triangle test of Woop, Benthin and Wald
+// the corners are moved into a space where the ray starts at the origin and runs along the kz axis,
+// so whether the ray passes a triangle edge is decided by the sign of a 2D edge function,
+// which the two triangles sharing the edge compute from the same values with opposite signs
+// and a ray can't slip through between them
+struct WatertightRay {
+	glm::vec3 origin;
+	int kx, ky, kz;		// kz is the axis the direction is largest in, kx and ky keep the winding of the triangles
+	float sx, sy, sz;	// shear that turns the direction into the kz axis
+
+	WatertightRay() {};
+	WatertightRay(const glm::vec3& origin, const glm::vec3& direction);
+};
+
+// where a ray hits a triangle
+struct TriangleHit {
+	float t;	// distance along the ray in multiples of its direction
+	float u, v;	// barycentric coordinates, the weights of corner 1 and corner 2
+};
+
+// true if the ray hits the triangle with corners a, b and c within [0, tmax] times its direction
+// hits on an edge or a corner count, rays in the plane of the triangle don't hit it
+bool intersectTriangle(const WatertightRay& ray, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c, float tmax, TriangleHit& hit);
+
+inline bool intersectTriangle(const WatertightRay& ray, const Triangle& triangle, float tmax, TriangleHit& hit) {
+	return intersectTriangle(ray, triangle.getCorner(0), triangle.getCorner(1), triangle.getCorner(2), tmax, hit);
+}
+
+// remembers the triangles one ray has already tested
+// triangles crossing split planes are referenced by several leaves, but a ray only has to test them once
+struct Mailbox {
+	static constexpr uint32_t SIZE = 16;	// power of two, the low bits of the triangle index pick the slot
+	uint32_t tested[SIZE];
+
+	void clear() {
+		for (uint32_t& slot : tested) {
+			slot = UINT32_MAX;
+		}
+	};
+	// true if the triangle still has to be tested, it counts as tested afterwards
+	bool check(uint32_t triangle) {
+		uint32_t& slot = tested[triangle & (SIZE - 1)];
+		if (slot == triangle)
+			return false;
+		slot = triangle;
+		return true;
+	};
+};
+
+// corners of the triangles a structure references from its leaves, in the order of its triangle index list
+// every coordinate has its own array, so the triangles of a leaf are consecutive in each of them and are loaded
+// straight into the lanes of one SIMD test, and the traversal never touches the triangles with their model matrices
+// the corners are copies, a structure fills them again whenever its triangles move
+struct TriangleRecords {
+	static const size_t PADDING = 8;	// entries after the last reference that a SIMD load of a leaf at the end may read
+	ArenaArray<float> corners[3][3];	// [corner][axis][reference]
+
+	// room for capacity references in the arena, the entries set so far are kept
+	void reserve(Arena& arena, size_t capacity);
+	void set(size_t reference, const Triangle& triangle) {
+		for (int corner = 0; corner < 3; corner++) {
+			glm::vec3 position = triangle.getCorner(corner);
+			for (int axis = 0; axis < 3; axis++) {
+				corners[corner][axis][reference] = position[axis];
+			}
+		}
+	}
+	// sets the references [first, end) from the triangles the index list points to
+	void fill(const Triangle* triangles, const uint32_t* indices, size_t first, size_t end) {
+		for (size_t reference = first; reference < end; reference++) {
+			set(reference, triangles[indices[reference]]);
+		}
+	}
+	glm::vec3 corner(size_t reference, int corner) const {
+		return glm::vec3(corners[corner][0][reference], corners[corner][1][reference], corners[corner][2][reference]);
+	}
+	size_t bytes() const { return corners[0][0].size() * 9 * sizeof(float); };
+};
+
+inline bool intersectTriangle(const WatertightRay& ray, const TriangleRecords& records, size_t reference, float tmax, TriangleHit& hit) {
+	return intersectTriangle(ray, records.corner(reference, 0), records.corner(reference, 1), records.corner(reference, 2), tmax, hit);
+}
+
+// the closest of the count references from first on that the ray hits within [0, tmax] times its direction,
+// returns its offset from first or -1 if it hits none, the lanes set in skipped are left out
+// 4 triangles are tested with SSE and 8 with AVX, the result is the same as testing them one by one with intersectTriangle
+template <int WIDTH>
+int intersectPack(const WatertightRay& ray, const TriangleRecords& records, size_t first, int count, float tmax, TriangleHit& hit, int skipped = 0);
+
+// intersectPack over the references of a leaf of any size
+int intersectTriangles(const WatertightRay& ray, const TriangleRecords& records, size_t first, uint32_t count, float tmax, TriangleHit& hit);
+// the same for the references of a leaf whose triangles may be referenced by other leaves as well,
+// indices are the triangles of the references and the ones the mailbox knows already are left out
+int intersectTriangles(const WatertightRay& ray, const TriangleRecords& records, const uint32_t* indices, size_t first, uint32_t count, Mailbox& mailbox, float tmax, TriangleHit& hit);
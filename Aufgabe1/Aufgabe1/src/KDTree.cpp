@@ -1,292 +1,2124 @@
 #include "KDTree.h"
 #include "Triangle.h"
 #include "Box.h"
+#include "Simd.h"
 #include <iostream>
 #include <algorithm>
+#include <utility>
+#include <cmath>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
-KDTree::KDTree(std::vector<Triangle>& triangles, float minVal, float maxVal) {
-	root = new Node;
-	SortTriangles(triangles, 0, triangles.size() - 1, root);
-	fillBoxes(root, minVal - 1, maxVal + 1, minVal - 1, maxVal + 1, minVal - 1, maxVal + 1);
+namespace {
+	// subtrees over at least this many triangles are built as separate tasks
+	const int PARALLEL_TASK_SIZE = 4096;
+	// lists with at least this many elements are partitioned by all threads together
+	const size_t PARALLEL_PARTITION_SIZE = 65536;
+	// an update only rebuilds a subtree if it caused at least this share of the cost growth of its parent
+	// if the growth is spread more evenly, the parent is rebuilt instead
+	const float PARTIAL_REBUILD_SHARE = 0.75f;
+	// the traversal stack holds at most one node per level, so the builders never go deeper
+	const int MAX_DEPTH = 64;
+	static_assert(MAX_DEPTH * AccelerationStructure::MAX_PACKET <= TraversalContext::STACK_SIZE, "the intervals of a packet have to fit into the stack of a context");
+	static_assert(sizeof(TraversalContext::mailboxes) / sizeof(Mailbox) >= AccelerationStructure::MAX_PACKET, "every ray of a packet needs a mailbox");
+
+	// the depth limit stops the duplication of straddling triangles from running away
+	int maxDepthFor(size_t triangleCount) {
+		return (int)(8 + 1.3f * std::log2((float)std::max<size_t>(triangleCount, 1)));
+	}
+
+	// interval [tnear, tfar] of the ray inside the bounds within [0, tmax], false if the ray misses them
+	bool clipRay(const glm::vec3& boundsMin, const glm::vec3& boundsMax, const glm::vec3& origin, const glm::vec3& inverse, float tmax, float& tnear, float& tfar) {
+		tnear = 0.0f;
+		tfar = tmax;
+		for (int axis = 0; axis < 3; axis++) {
+			float t0 = (boundsMin[axis] - origin[axis]) * inverse[axis];
+			float t1 = (boundsMax[axis] - origin[axis]) * inverse[axis];
+			if (t0 > t1)
+				std::swap(t0, t1);
+			tnear = std::max(tnear, t0);
+			tfar = std::min(tfar, t1);
+		}
+		return tnear <= tfar;
+	}
+
+	// sides of a split plane the rays of a packet enter
+	const int NEAR_SIDE = 1;
+	const int FAR_SIDE = 2;
+
+	// splits the intervals of the rays of a packet where they cross the plane at t = (split - origin) * inverse
+	// the near side keeps [tnear, min(t, tfar)] and the far side [max(t, tnear), tfar], an empty interval means the ray skips the side
+	// returns the sides that at least one ray enters, lanes is a multiple of 4
+	int splitIntervals(const float* origins, const float* inverses, float split, int lanes, const float* tnear, const float* tfar, float* nearTfar, float* farTnear) {
+		int sides = 0;
+		int lane = 0;
+		// t is the first operand of min and max, so a ray inside the plane (t is NaN) keeps its interval on both sides
+#ifdef KDTREE_AVX
+		__m256 split8 = _mm256_set1_ps(split);
+		for (; lane + 8 <= lanes; lane += 8) {
+			__m256 t = _mm256_mul_ps(_mm256_sub_ps(split8, _mm256_load_ps(origins + lane)), _mm256_load_ps(inverses + lane));
+			__m256 low = _mm256_load_ps(tnear + lane);
+			__m256 high = _mm256_load_ps(tfar + lane);
+			__m256 nearHigh = _mm256_min_ps(t, high);
+			__m256 farLow = _mm256_max_ps(t, low);
+			_mm256_store_ps(nearTfar + lane, nearHigh);
+			_mm256_store_ps(farTnear + lane, farLow);
+			if (_mm256_movemask_ps(_mm256_cmp_ps(low, nearHigh, _CMP_LE_OQ)) != 0)
+				sides |= NEAR_SIDE;
+			if (_mm256_movemask_ps(_mm256_cmp_ps(farLow, high, _CMP_LE_OQ)) != 0)
+				sides |= FAR_SIDE;
+		}
+#endif
+#ifdef KDTREE_SSE
+		__m128 split4 = _mm_set1_ps(split);
+		for (; lane + 4 <= lanes; lane += 4) {
+			__m128 t = _mm_mul_ps(_mm_sub_ps(split4, _mm_load_ps(origins + lane)), _mm_load_ps(inverses + lane));
+			__m128 low = _mm_load_ps(tnear + lane);
+			__m128 high = _mm_load_ps(tfar + lane);
+			__m128 nearHigh = _mm_min_ps(t, high);
+			__m128 farLow = _mm_max_ps(t, low);
+			_mm_store_ps(nearTfar + lane, nearHigh);
+			_mm_store_ps(farTnear + lane, farLow);
+			if (_mm_movemask_ps(_mm_cmple_ps(low, nearHigh)) != 0)
+				sides |= NEAR_SIDE;
+			if (_mm_movemask_ps(_mm_cmple_ps(farLow, high)) != 0)
+				sides |= FAR_SIDE;
+		}
+#endif
+		for (; lane < lanes; lane++) {
+			float t = (split - origins[lane]) * inverses[lane];
+			nearTfar[lane] = t < tfar[lane] ? t : tfar[lane];
+			farTnear[lane] = t > tnear[lane] ? t : tnear[lane];
+			if (tnear[lane] <= nearTfar[lane])
+				sides |= NEAR_SIDE;
+			if (farTnear[lane] <= tfar[lane])
+				sides |= FAR_SIDE;
+		}
+		return sides;
+	}
+
+	float halfArea(const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+		glm::vec3 size = boundsMax - boundsMin;
+		return size.x * size.y + size.y * size.z + size.z * size.x;
+	}
+
+	// smallest and biggest value of two arrays, four elements at a time
+	void minMaxOf(const float* mins, const float* maxs, size_t count, float& lowest, float& highest) {
+		lowest = FLT_MAX;
+		highest = -FLT_MAX;
+		size_t i = 0;
+#ifdef KDTREE_SSE
+		__m128 low = _mm_set1_ps(FLT_MAX);
+		__m128 high = _mm_set1_ps(-FLT_MAX);
+		for (; i + 4 <= count; i += 4) {
+			low = _mm_min_ps(low, _mm_loadu_ps(mins + i));
+			high = _mm_max_ps(high, _mm_loadu_ps(maxs + i));
+		}
+		float lows[4], highs[4];
+		_mm_storeu_ps(lows, low);
+		_mm_storeu_ps(highs, high);
+		for (int lane = 0; lane < 4; lane++) {
+			lowest = std::min(lowest, lows[lane]);
+			highest = std::max(highest, highs[lane]);
+		}
+#endif
+		for (; i < count; i++) {
+			lowest = std::min(lowest, mins[i]);
+			highest = std::max(highest, maxs[i]);
+		}
+	}
+
+	// counts the values per bin, the bin index is computed for four values at a time
+	void countBins(const float* values, size_t count, float origin, float scale, int binCount, int* bins) {
+		size_t i = 0;
+		float lastBin = (float)(binCount - 1);
+#ifdef KDTREE_SSE
+		__m128 originSSE = _mm_set1_ps(origin);
+		__m128 scaleSSE = _mm_set1_ps(scale);
+		__m128 zero = _mm_setzero_ps();
+		__m128 last = _mm_set1_ps(lastBin);
+		alignas(16) int binIndex[4];
+		for (; i + 4 <= count; i += 4) {
+			__m128 bin = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(values + i), originSSE), scaleSSE);
+			bin = _mm_min_ps(_mm_max_ps(bin, zero), last);
+			_mm_store_si128((__m128i*)binIndex, _mm_cvttps_epi32(bin));
+			bins[binIndex[0]]++;
+			bins[binIndex[1]]++;
+			bins[binIndex[2]]++;
+			bins[binIndex[3]]++;
+		}
+#endif
+		for (; i < count; i++) {
+			float bin = std::min(std::max((values[i] - origin) * scale, 0.0f), lastBin);
+			bins[(int)bin]++;
+		}
+	}
+
+	// clips the triangle against the six planes of the box (Sutherland-Hodgman) and returns the bounds of what is left
+	// returns false if the triangle does not touch the box at all
+	bool clipTriangle(const Triangle& triangle, const glm::vec3& boxMin, const glm::vec3& boxMax, glm::vec3& clipMin, glm::vec3& clipMax) {
+		// every plane adds at most one corner to the polygon
+		glm::vec3 polygon[9], clipped[9];
+		int corners = 3;
+		for (int i = 0; i < 3; i++) {
+			polygon[i] = triangle.getCorner(i);
+		}
+
+		for (int plane = 0; plane < 6 && corners > 0; plane++) {
+			int axis = plane % 3;
+			bool lower = plane < 3;
+			float bound = lower ? boxMin[axis] : boxMax[axis];
+			int count = 0;
+			for (int i = 0; i < corners; i++) {
+				const glm::vec3& from = polygon[i];
+				const glm::vec3& to = polygon[(i + 1) % corners];
+				bool fromInside = lower ? from[axis] >= bound : from[axis] <= bound;
+				bool toInside = lower ? to[axis] >= bound : to[axis] <= bound;
+				if (fromInside)
+					clipped[count++] = from;
+				if (fromInside != toInside) {
+					glm::vec3 crossing = from + (to - from) * ((bound - from[axis]) / (to[axis] - from[axis]));
+					// rounding must not move the new corner out of the box again
+					crossing[axis] = bound;
+					clipped[count++] = crossing;
+				}
+			}
+			corners = count;
+			std::copy(clipped, clipped + count, polygon);
+		}
+
+		if (corners == 0)
+			return false;
+		clipMin = polygon[0];
+		clipMax = polygon[0];
+		for (int i = 1; i < corners; i++) {
+			clipMin = glm::min(clipMin, polygon[i]);
+			clipMax = glm::max(clipMax, polygon[i]);
+		}
+		// the clipped polygon lies in the box, the clamp only removes rounding errors of the other coordinates
+		clipMin = glm::clamp(clipMin, boxMin, boxMax);
+		clipMax = glm::clamp(clipMax, boxMin, boxMax);
+		return true;
+	}
+
+	// places the nth smallest index of [from, to] at position nth, like std::nth_element
+	// large ranges near the root are partitioned around a pivot by all threads of the pool first
+	template <typename Less>
+	void parallelNthElement(ThreadPool& pool, std::vector<uint32_t>& indices, std::vector<uint32_t>& scratch, int from, int nth, int to, Less less) {
+		while (pool.size() > 1 && (size_t)(to - from + 1) >= PARALLEL_PARTITION_SIZE) {
+			uint32_t a = indices[from], b = indices[from + (to - from) / 2], c = indices[to];
+			uint32_t pivot;
+			if (less(a, b))
+				pivot = less(b, c) ? b : (less(a, c) ? c : a);
+			else
+				pivot = less(a, c) ? a : (less(b, c) ? c : b);
+
+			// every chunk counts its elements smaller than the pivot, the prefix sums tell each chunk where to write
+			size_t count = to - from + 1;
+			size_t chunkCount = pool.size() * 4;
+			size_t chunkSize = (count + chunkCount - 1) / chunkCount;
+			std::vector<size_t> smaller(chunkCount, 0), smallerOffset(chunkCount), biggerOffset(chunkCount);
+			pool.parallelFor(chunkCount, 1, [&](size_t begin, size_t end) {
+				for (size_t chunk = begin; chunk < end; chunk++) {
+					size_t last = std::min((chunk + 1) * chunkSize, count);
+					for (size_t i = chunk * chunkSize; i < last; i++) {
+						if (less(indices[from + i], pivot))
+							smaller[chunk]++;
+					}
+				}
+			});
+			size_t smallerTotal = 0, biggerTotal = 0;
+			for (size_t chunk = 0; chunk < chunkCount; chunk++) {
+				size_t chunkLength = std::min((chunk + 1) * chunkSize, count) - std::min(chunk * chunkSize, count);
+				smallerOffset[chunk] = smallerTotal;
+				biggerOffset[chunk] = biggerTotal;
+				smallerTotal += smaller[chunk];
+				biggerTotal += chunkLength - smaller[chunk];
+			}
+
+			size_t pivotPos = 0;
+			pool.parallelFor(chunkCount, 1, [&](size_t begin, size_t end) {
+				for (size_t chunk = begin; chunk < end; chunk++) {
+					size_t smallerPos = from + smallerOffset[chunk];
+					size_t biggerPos = from + smallerTotal + biggerOffset[chunk];
+					size_t last = std::min((chunk + 1) * chunkSize, count);
+					for (size_t i = chunk * chunkSize; i < last; i++) {
+						uint32_t index = indices[from + i];
+						if (less(index, pivot)) {
+							scratch[smallerPos++] = index;
+						}
+						else {
+							if (index == pivot)
+								pivotPos = biggerPos;
+							scratch[biggerPos++] = index;
+						}
+					}
+				}
+			});
+			pool.parallelFor(count, PARALLEL_PARTITION_SIZE / 4, [&](size_t begin, size_t end) {
+				std::copy(scratch.begin() + from + begin, scratch.begin() + from + end, indices.begin() + from + begin);
+			});
+
+			// the pivot is the smallest of the second part, so it is already at its final place once moved to the front of it
+			int split = from + (int)smallerTotal;
+			std::swap(indices[split], indices[pivotPos]);
+			if (nth == split)
+				return;
+			if (nth < split)
+				to = split - 1;
+			else
+				from = split + 1;
+		}
+		std::nth_element(indices.begin() + from, indices.begin() + nth, indices.begin() + to + 1, less);
+	}
+
+	// queries of a neighbour batch the threads take at once
+	const size_t NEIGHBOUR_GRAIN = 64;
+
+	// squared distance from the point to the bounds, 0 inside of them
+	float squaredDistance(const glm::vec3& point, const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+		glm::vec3 outside = glm::max(glm::max(boundsMin - point, point - boundsMax), glm::vec3(0.0f));
+		return glm::dot(outside, outside);
+	}
+
+	// every plane of a frustum has a bit in the plane masks of a range query
+	const uint32_t ALL_PLANES = (1u << 6) - 1;
+
+	// a range query result with fewer than one reference per this many triangles is deduplicated by sorting it,
+	// a longer one with a bit set over all triangles
+	// the bit set costs a clear and a scan of one word per 32 triangles whatever the result, sorting grows with it,
+	// the two cost the same between one reference per 128 triangles for 100k triangles and one per 512 for 10M
+	const size_t SORT_DEDUPE_RATIO = 256;
+
+	// false if the bounds lie outside of one of the planes in the mask, the planes they lie inside of are removed from it
+	bool overlapsPlanes(const Frustum& frustum, const glm::vec3& boundsMin, const glm::vec3& boundsMax, uint32_t& planes) {
+		for (int i = 0; i < 6; i++) {
+			if ((planes & (1u << i)) == 0)
+				continue;
+			const glm::vec4& plane = frustum.planes[i];
+			// the corners of the bounds furthest along the normal and furthest against it
+			glm::vec3 inner, outer;
+			for (int axis = 0; axis < 3; axis++) {
+				inner[axis] = plane[axis] >= 0.0f ? boundsMax[axis] : boundsMin[axis];
+				outer[axis] = plane[axis] >= 0.0f ? boundsMin[axis] : boundsMax[axis];
+			}
+			if (glm::dot(glm::vec3(plane), inner) + plane.w < 0.0f)
+				return false;
+			if (glm::dot(glm::vec3(plane), outer) + plane.w >= 0.0f)
+				planes &= ~(1u << i);
+		}
+		return true;
+	}
+
+	// true if the triangle and the box touch, by the separating axis test of Akenine-Moeller
+	// the candidate axes are the normals of the box, the normal of the triangle and the cross products of its edges with the box normals
+	bool triangleOverlapsBox(const glm::vec3& boxCenter, const glm::vec3& halfSize, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c) {
+		const glm::vec3 corners[3] = { a - boxCenter, b - boxCenter, c - boxCenter };
+		for (int axis = 0; axis < 3; axis++) {
+			float lowest = std::min(std::min(corners[0][axis], corners[1][axis]), corners[2][axis]);
+			float highest = std::max(std::max(corners[0][axis], corners[1][axis]), corners[2][axis]);
+			if (lowest > halfSize[axis] || highest < -halfSize[axis])
+				return false;
+		}
+		const glm::vec3 edges[3] = { corners[1] - corners[0], corners[2] - corners[1], corners[0] - corners[2] };
+		for (int edge = 0; edge < 3; edge++) {
+			for (int axis = 0; axis < 3; axis++) {
+				glm::vec3 normal(0.0f);
+				normal[axis] = 1.0f;
+				glm::vec3 direction = glm::cross(normal, edges[edge]);
+				float first = glm::dot(direction, corners[0]);
+				float second = glm::dot(direction, corners[1]);
+				float third = glm::dot(direction, corners[2]);
+				float radius = glm::dot(halfSize, glm::abs(direction));
+				if (std::min(std::min(first, second), third) > radius || std::max(std::max(first, second), third) < -radius)
+					return false;
+			}
+		}
+		glm::vec3 normal = glm::cross(edges[0], edges[1]);
+		return std::abs(glm::dot(normal, corners[0])) <= glm::dot(halfSize, glm::abs(normal));
+	}
+
+	// index of the lowest set bit, the bits must not be 0
+	int lowestBit(uint64_t bits) {
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward64(&index, bits);
+		return (int)index;
+#else
+		return __builtin_ctzll(bits);
+#endif
+	}
+
+	// closer neighbours first, the triangle index decides between equal distances
+	bool neighbourLess(const Neighbour& first, const Neighbour& second) {
+		return first.distance < second.distance || (first.distance == second.distance && first.triangle < second.triangle);
+	}
+
+	// adds the triangle to an open addressing set whose size is a power of two, free slots hold UINT32_MAX
+	// the table is doubled once it is half full, returns false if the triangle was in the set already
+	bool insertTriangle(std::vector<uint32_t>& table, size_t& count, uint32_t triangle) {
+		if (2 * (count + 1) > table.size()) {
+			std::vector<uint32_t> previous(std::max<size_t>(16, 2 * table.size()), UINT32_MAX);
+			previous.swap(table);
+			count = 0;
+			for (uint32_t kept : previous) {
+				if (kept != UINT32_MAX)
+					insertTriangle(table, count, kept);
+			}
+		}
+		size_t mask = table.size() - 1;
+		for (size_t slot = (triangle * 0x9E3779B1u) & mask; ; slot = (slot + 1) & mask) {
+			if (table[slot] == triangle)
+				return false;
+			if (table[slot] == UINT32_MAX) {
+				table[slot] = triangle;
+				count++;
+				return true;
+			}
+		}
+	}
 }
 
-void KDTree::SortTriangles(std::vector<Triangle>& triangles, int from, int to, Node* currentNode) {
-	// test if this would be a leaf node
-	if (to == from) {
-		// if to and from are the same value, this sublist is only one object long
-		// the current node becomes a leaf node
-		currentNode->leftChild = nullptr;
-		currentNode->rightChild = nullptr;
-		currentNode->splitPlane = 'o';
-		currentNode->splitPos = 0.0f;
-		currentNode->contents = &triangles[to];
-		// std::cout << currentNode->contents->getCenterX() << " " << currentNode->contents->getCenterY() << " " << currentNode->contents->getCenterZ() << "\n";
-		// we don't have to go on because this was a leaf node;
+KDTree::KDTree(std::vector<Triangle>& triangles, float minVal, float maxVal, const BuildSettings& settings)
+	: spareArena(settings.hugePages), arena(settings.hugePages) {
+	build(triangles, minVal, maxVal, settings);
+}
+
+// the copy gets its own arena, the triangles stay shared
+KDTree::KDTree(const KDTree& other)
+	: AccelerationStructure(other), spareArena(other.arena.usesHugePages()), sceneMin(other.sceneMin), sceneMax(other.sceneMax), arena(other.arena.usesHugePages()) {
+	nodes = arena.copyArray(other.nodes.data(), other.nodes.size());
+	triangleIndices = arena.copyArray(other.triangleIndices.data(), other.triangleIndices.size());
+	builtCosts = arena.copyArray(other.builtCosts.data(), other.builtCosts.size());
+	resetLazy();
+	storeRecords();
+	storeBounds();
+}
+
+KDTree& KDTree::operator=(const KDTree& other) {
+	if (this != &other) {
+		KDTree copy(other);
+		*this = std::move(copy);
+	}
+	return *this;
+}
+
+void KDTree::build(Triangle* triangles, uint32_t count, float minVal, float maxVal, const BuildSettings& settings) {
+	this->settings = settings;
+	if (arena.usesHugePages() != settings.hugePages) {
+		arena = Arena(settings.hugePages);
+		spareArena = Arena(settings.hugePages);
+	}
+	triangleData = triangles;
+	triangleCount = count;
+	sceneMin = minVal;
+	sceneMax = maxVal;
+	rebuild();
+}
+
+// builds the whole tree from the current triangles
+void KDTree::rebuild() {
+	// everything of the previous build is released at once
+	arena.reset();
+	nodes = ArenaArray<Node>();
+	triangleIndices = ArenaArray<uint32_t>();
+	records = TriangleRecords();
+	for (int axis = 0; axis < 3; axis++) {
+		nodeMin[axis] = ArenaArray<float>();
+		nodeMax[axis] = ArenaArray<float>();
+	}
+	boxes = ArenaArray<Box>();
+	boxesStored = false;
+	builtCosts = ArenaArray<float>();
+
+	boundsMin = glm::vec3(FLT_MAX);
+	boundsMax = glm::vec3(-FLT_MAX);
+	BoundsSoA refs;
+	refs.reserve(triangleCount);
+	for (uint32_t i = 0; i < triangleCount; i++) {
+		boundsMin = glm::min(boundsMin, triangleData[i].getMin());
+		boundsMax = glm::max(boundsMax, triangleData[i].getMax());
+		refs.add(i, triangleData[i].getMin(), triangleData[i].getMax());
+	}
+
+	pool = &buildPool();
+	BuildOutput out;
+	out.nodes.resize(1);
+	if (settings.lazy)
+		deferSubtree(refs, depthLimit(), out);
+	else
+		buildSubtree(refs, boundsMin, boundsMax, depthLimit(), out);
+	pool = nullptr;
+
+	store(out);
+	builtCosts = arena.allocateArray<float>(nodes.size());
+	nodeCost(nodes.data(), 0, boundsMin, boundsMax, builtCosts.data());
+	degradation = 1.0f;
+}
+
+// builds, updates and expansions share the threads, so an animated or lazy tree doesn't start them for every change
+ThreadPool& KDTree::buildPool() const {
+	if (!threads || threadCount != settings.threads) {
+		threads.reset();
+		threads.reset(new ThreadPool(settings.threads));
+		threadCount = settings.threads;
+	}
+	return *threads;
+}
+
+// builds the (sub)tree over the references into the first node of the output with the selected strategy
+void KDTree::buildSubtree(BoundsSoA& refs, const glm::vec3& voxelMin, const glm::vec3& voxelMax, int depth, BuildOutput& out) const {
+	if (settings.mode == BuildMode::SAH)
+		BuildSAH(refs, voxelMin, voxelMax, depth, out);
+	else if (settings.mode == BuildMode::Binned)
+		SplitBinned(refs, voxelMin, voxelMax, 0, depth, out);
+	else {
+		// a node is done with the buffers before its children are built, so a thread needs one set for the whole recursion
+		if (medianBuffers.size() < pool->size())
+			medianBuffers.resize(pool->size());
+		SortTriangles(refs, voxelMin, voxelMax, 0, depth, out);
+		if (!settings.lazy) {
+			medianBuffers.clear();
+			medianBuffers.shrink_to_fit();
+		}
+	}
+}
+
+// turns the first node of the output into a pending leaf over the references, a query reaching it builds the split
+void KDTree::deferSubtree(const BoundsSoA& refs, int depth, BuildOutput& out) const {
+	uint32_t first = (uint32_t)out.indices.size();
+	uint32_t count = (uint32_t)refs.size();
+	if (count > (uint32_t)std::max(settings.maxLeafSize, 1) && depth > 0)
+		out.nodes[0] = Node::pending(first, count);
+	else
+		out.nodes[0] = Node::leaf(first, count);
+	out.indices.insert(out.indices.end(), refs.triangle.begin(), refs.triangle.end());
+}
+
+// moves the finished tree into the arena, the build buffers are freed with the output
+void KDTree::store(const BuildOutput& out) {
+	nodes = arena.copyArray(out.nodes.data(), out.nodes.size());
+	triangleIndices = arena.copyArray(out.indices.data(), out.indices.size());
+	resetLazy();
+	storeRecords();
+	storeBounds();
+}
+
+// copies the corners of the referenced triangles next to the index list, the arena may have been reset since the last call
+void KDTree::storeRecords() {
+	records = TriangleRecords();
+	records.reserve(arena, triangleIndices.size());
+	records.fill(triangleData, triangleIndices.data(), 0, triangleIndices.size());
+}
+
+// the arrays were replaced, the pending nodes are looked up again by the next expansion
+void KDTree::resetLazy() {
+	if (!settings.lazy) {
+		lazy.reset();
 		return;
 	}
+	if (!lazy)
+		lazy.reset(new LazyState());
+	lazy->pending.clear();
+	lazy->nodeCapacity = nodes.size();
+	lazy->indexCapacity = triangleIndices.size();
+}
+
+void KDTree::collectPending(uint32_t node, const glm::vec3& voxelMin, const glm::vec3& voxelMax, int depth) const {
+	const Node& current = nodes[node];
+	if (current.isPending()) {
+		lazy->pending[node] = { voxelMin, voxelMax, depth };
+		return;
+	}
+	if (current.isLeaf())
+		return;
+	int axis = current.axis();
+	float pos = glm::clamp(current.split(), voxelMin[axis], voxelMax[axis]);
+	glm::vec3 leftMax = voxelMax;
+	glm::vec3 rightMin = voxelMin;
+	leftMax[axis] = pos;
+	rightMin[axis] = pos;
+	collectPending(current.leftChild(), voxelMin, leftMax, depth - 1);
+	collectPending(current.rightChild(), rightMin, voxelMax, depth - 1);
+}
+
+// called by a query that holds the node lock shared and reached a pending node
+// the lock is given up while the node is split, so the query has to read the node again afterwards
+void KDTree::expandNode(uint32_t node) const {
+	lazy->nodeLock.unlock_shared();
+	{
+		std::lock_guard<std::mutex> expanding(lazy->expansionLock);
+		// another query may have split the node while this one waited
+		if (nodes[node].isPending())
+			splitPending(node);
+	}
+	lazy->nodeLock.lock_shared();
+}
+
+// builds one level below the pending node and publishes it, the new children are pending again if they are worth splitting
+void KDTree::splitPending(uint32_t node) const {
+	auto found = lazy->pending.find(node);
+	if (found == lazy->pending.end()) {
+		lazy->pending.clear();
+		collectPending(0, boundsMin, boundsMax, depthLimit());
+		found = lazy->pending.find(node);
+	}
+	PendingNode pending = found->second;
+	lazy->pending.erase(found);
+
+	// only the owner of the expansion lock changes the arrays, so they can be read without the node lock
+	const Node current = nodes[node];
+	BoundsSoA refs;
+	refs.reserve(current.triangleCount());
+	for (uint32_t i = current.firstTriangle(); i < current.firstTriangle() + current.triangleCount(); i++) {
+		glm::vec3 refMin, refMax;
+		if (clippedBounds(triangleIndices[i], pending.voxelMin, pending.voxelMax, refMin, refMax))
+			refs.add(triangleIndices[i], refMin, refMax);
+	}
+	pool = &buildPool();
+	BuildOutput out;
+	out.nodes.resize(1);
+	buildSubtree(refs, pending.voxelMin, pending.voxelMax, 1, out);
+	pool = nullptr;
+
+	// the list of the pending node is not needed anymore, the new leaves take it over as far as they fit
+	// and the rest is appended to the index list
+	uint32_t reused = current.firstTriangle();
+	uint32_t room = current.triangleCount();
+	uint32_t appended = 0;
+	std::vector<uint32_t> firsts(out.nodes.size());
+	for (size_t i = 0; i < out.nodes.size(); i++) {
+		uint32_t count = out.nodes[i].isLeaf() ? out.nodes[i].triangleCount() : 0;
+		if (count <= room) {
+			firsts[i] = reused;
+			reused += count;
+			room -= count;
+		}
+		else {
+			firsts[i] = (uint32_t)triangleIndices.size() + appended;
+			appended += count;
+		}
+	}
+
+	std::unique_lock<std::shared_timed_mutex> publishing(lazy->nodeLock);
+	size_t nodeCount = nodes.size() + out.nodes.size() - 1;
+	if (nodeCount > lazy->nodeCapacity) {
+		lazy->nodeCapacity = std::max(nodeCount, lazy->nodeCapacity * 2);
+		nodes = arena.growArray(nodes, lazy->nodeCapacity);
+		for (int axis = 0; axis < 3; axis++) {
+			nodeMin[axis] = arena.growArray(nodeMin[axis], lazy->nodeCapacity);
+			nodeMax[axis] = arena.growArray(nodeMax[axis], lazy->nodeCapacity);
+		}
+		if (!builtCosts.empty())
+			builtCosts = arena.growArray(builtCosts, lazy->nodeCapacity);
+	}
+	size_t indexCount = triangleIndices.size() + appended;
+	if (indexCount > lazy->indexCapacity) {
+		lazy->indexCapacity = std::max(indexCount, lazy->indexCapacity * 2);
+		triangleIndices = arena.growArray(triangleIndices, lazy->indexCapacity);
+		records.reserve(arena, lazy->indexCapacity);
+	}
+	triangleIndices.count = indexCount;
 
-	// find on which axis they are spread out more
-	float maxX = -FLT_MAX, minX = FLT_MAX;
-	float maxY = -FLT_MAX, minY = FLT_MAX;
-	float maxZ = -FLT_MAX, minZ = FLT_MAX;
-	for (int i = from; i <= to; i++) {
+	// the root of the output replaces the pending node, the children go to the end of the node array
+	uint32_t nodeBase = (uint32_t)nodes.size() - 1;
+	nodes.count = nodeCount;
+	for (int axis = 0; axis < 3; axis++) {
+		nodeMin[axis].count = nodeCount;
+		nodeMax[axis].count = nodeCount;
+	}
+	builtCosts.count = builtCosts.empty() ? 0 : nodeCount;
+	for (size_t i = 0; i < out.nodes.size(); i++) {
+		const Node& built = out.nodes[i];
+		uint32_t slot = i == 0 ? node : nodeBase + (uint32_t)i;
+		if (!built.isLeaf()) {
+			nodes[slot] = built.relocated(nodeBase, 0);
+			continue;
+		}
+		std::copy(out.indices.begin() + built.firstTriangle(), out.indices.begin() + built.firstTriangle() + built.triangleCount(), triangleIndices.begin() + firsts[i]);
+		records.fill(triangleData, triangleIndices.data(), firsts[i], firsts[i] + built.triangleCount());
+		nodes[slot] = Node::leaf(firsts[i], built.triangleCount());
+	}
+	// the bounds of the node stay the same, its new children get their own
+	fitBounds(node, pending.voxelMin, pending.voxelMax);
+	boxesStored = false;
+	const Node& split = nodes[node];
+	if (split.isLeaf())
+		return;
 
-		if (triangles[i].getCenterX() > maxX)
-			maxX = triangles[i].getCenterX();
-		if (triangles[i].getCenterX() < minX)
-			minX = triangles[i].getCenterX();
+	int axis = split.axis();
+	glm::vec3 leftMax = pending.voxelMax;
+	glm::vec3 rightMin = pending.voxelMin;
+	leftMax[axis] = split.split();
+	rightMin[axis] = split.split();
+	const glm::vec3 childMin[2] = { pending.voxelMin, rightMin };
+	const glm::vec3 childMax[2] = { leftMax, pending.voxelMax };
+	for (uint32_t side = 0; side < 2; side++) {
+		uint32_t child = split.leftChild() + side;
+		const Node leaf = nodes[child];
+		if (leaf.triangleCount() > (uint32_t)std::max(settings.maxLeafSize, 1) && pending.depth > 1) {
+			nodes[child] = Node::pending(leaf.firstTriangle(), leaf.triangleCount());
+			lazy->pending[child] = { childMin[side], childMax[side], pending.depth - 1 };
+		}
+		if (!builtCosts.empty())
+			builtCosts[child] = halfArea(childMin[side], childMax[side]) * settings.intersectionCost * leaf.triangleCount();
+	}
+}
 
-		if (triangles[i].getCenterY() > maxY)
-			maxY = triangles[i].getCenterY();
-		if (triangles[i].getCenterY() < minY)
-			minY = triangles[i].getCenterY();
+// fits the bounds of every node in one pass over the tree, the records have to be stored already
+void KDTree::storeBounds() {
+	for (int axis = 0; axis < 3; axis++) {
+		nodeMin[axis] = arena.allocateArray<float>(nodes.size());
+		nodeMax[axis] = arena.allocateArray<float>(nodes.size());
+	}
+	boxesStored = false;
+	if (!nodes.empty())
+		fitBounds(0, boundsMin, boundsMax);
+}
 
-		if (triangles[i].getCenterZ() > maxZ)
-			maxZ = triangles[i].getCenterZ();
-		if (triangles[i].getCenterZ() < minZ)
-			minZ = triangles[i].getCenterZ();
+// the bounds of a leaf are those of its triangles inside the voxel, an interior node gets the union of its children's bounds
+// the voxels are passed down and the bounds come back up, so the subtree is visited once
+void KDTree::fitBounds(uint32_t node, const glm::vec3& voxelMin, const glm::vec3& voxelMax) const {
+	glm::vec3 fitMin(FLT_MAX), fitMax(-FLT_MAX);
+	const Node current = nodes[node];
+	if (current.isLeaf()) {
+		for (uint32_t i = current.firstTriangle(); i < current.firstTriangle() + current.triangleCount(); i++) {
+			glm::vec3 refMin = glm::min(glm::min(records.corner(i, 0), records.corner(i, 1)), records.corner(i, 2));
+			glm::vec3 refMax = glm::max(glm::max(records.corner(i, 0), records.corner(i, 1)), records.corner(i, 2));
+			refMin = glm::max(refMin, voxelMin);
+			refMax = glm::min(refMax, voxelMax);
+			// a reference whose bounds lie outside of the voxel adds nothing
+			if (refMin.x > refMax.x || refMin.y > refMax.y || refMin.z > refMax.z)
+				continue;
+			fitMin = glm::min(fitMin, refMin);
+			fitMax = glm::max(fitMax, refMax);
+		}
 	}
+	else {
+		int axis = current.axis();
+		float pos = glm::clamp(current.split(), voxelMin[axis], voxelMax[axis]);
+		glm::vec3 leftMax = voxelMax;
+		glm::vec3 rightMin = voxelMin;
+		leftMax[axis] = pos;
+		rightMin[axis] = pos;
+		fitBounds(current.leftChild(), voxelMin, leftMax);
+		fitBounds(current.rightChild(), rightMin, voxelMax);
+		for (uint32_t child = current.leftChild(); child <= current.rightChild(); child++) {
+			for (int i = 0; i < 3; i++) {
+				fitMin[i] = std::min(fitMin[i], nodeMin[i][child]);
+				fitMax[i] = std::max(fitMax[i], nodeMax[i][child]);
+			}
+		}
+	}
+	for (int i = 0; i < 3; i++) {
+		nodeMin[i][node] = fitMin[i];
+		nodeMax[i][node] = fitMax[i];
+	}
+}
+
+// the boxes are the bounds of the nodes with triangles below them
+void KDTree::storeBoxes() {
+	boxes = arena.allocateArray<Box>(nodes.size());
+	boxes.count = 0;
+	for (size_t i = 0; i < nodes.size(); i++) {
+		if (nodeMin[0][i] <= nodeMax[0][i])
+			boxes[boxes.count++] = Box(nodeMin[0][i], nodeMax[0][i], nodeMin[1][i], nodeMax[1][i], nodeMin[2][i], nodeMax[2][i]);
+	}
+}
 
-	float deltaX = maxX - minX;
-	float deltaY = maxY - minY;
-	float deltaZ = maxZ - minZ;
+// builds the median split tree
+// the planes only bound the geometry if triangles crossing them are referenced by both children,
+// so every node keeps its own list of references with their bounds clipped to the node's voxel
+// the lists of the children come from the stack of lists in the thread's buffers and keep their memory for the next
+// nodes at the same level, so the build only allocates while that stack grows
+void KDTree::SortTriangles(BoundsSoA& refs, const glm::vec3& voxelMin, const glm::vec3& voxelMax, uint32_t node, int depth, BuildOutput& out) const {
+	int count = (int)refs.size();
+	// test if this would be a leaf node
+	if (count <= std::max(settings.maxLeafSize, 1) || depth == 0) {
+		// the list is small enough, the current node becomes a leaf node holding the whole bucket
+		out.nodes[node] = Node::leaf((uint32_t)out.indices.size(), (uint32_t)count);
+		out.indices.insert(out.indices.end(), refs.triangle.begin(), refs.triangle.end());
+		// we don't have to go on because this was a leaf node;
+		return;
+	}
 
+	// find on which axis the centers of the clipped references are spread out more
+	// the clipped centers always lie inside the voxel, so the median plane does as well
+	glm::vec3 minCenter(FLT_MAX), maxCenter(-FLT_MAX);
+	for (int i = 0; i < count; i++) {
+		for (int axis = 0; axis < 3; axis++) {
+			float center = (refs.min[axis][i] + refs.max[axis][i]) / 2;
+			minCenter[axis] = std::min(minCenter[axis], center);
+			maxCenter[axis] = std::max(maxCenter[axis], center);
+		}
+	}
+
+	float deltaX = maxCenter.x - minCenter.x;
+	float deltaY = maxCenter.y - minCenter.y;
+	float deltaZ = maxCenter.z - minCenter.z;
+
+	int axis;
 	if (deltaX > deltaY && deltaX > deltaZ)
-		currentNode->splitPlane = 'x';
+		axis = 0;
 	else if (deltaY > deltaX && deltaY > deltaZ)
-		currentNode->splitPlane = 'y';
+		axis = 1;
 	else
-		currentNode->splitPlane = 'z';
+		axis = 2;
 
-	// sort the array along the selected axis
-	if (currentNode->splitPlane == 'x')
-		std::sort(triangles.begin() + from, triangles.begin() + to + 1, [](const Triangle& first, const Triangle& second)->bool
-			{
-				return first.getCenterX() < second.getCenterX();
-			});
-	else if (currentNode->splitPlane == 'y')
-		std::sort(triangles.begin() + from, triangles.begin() + to + 1, [](const Triangle& first, const Triangle& second)->bool
-			{
-				return first.getCenterY() < second.getCenterY();
-			});
-	else if (currentNode->splitPlane == 'z')
-		std::sort(triangles.begin() + from, triangles.begin() + to + 1, [](const Triangle& first, const Triangle& second)->bool
-			{
-				return first.getCenterZ() < second.getCenterZ();
-			});
+	// we only need the median in place, everything smaller ends up before it and everything bigger after it
+	// the position in the list breaks ties, so serial and parallel builds pick the same plane
+	MedianBuffers& buffers = medianBuffers[pool->index()];
+	std::vector<float>& centers = buffers.centers;
+	std::vector<uint32_t>& order = buffers.order;
+	centers.resize(count);
+	order.resize(count);
+	for (int i = 0; i < count; i++) {
+		centers[i] = (refs.min[axis][i] + refs.max[axis][i]) / 2;
+		order[i] = (uint32_t)i;
+	}
+	// the parallel partitioning near the root needs room to scatter the indices
+	if (pool->size() > 1 && (size_t)count >= PARALLEL_PARTITION_SIZE)
+		buffers.scratch.resize(count);
+	auto axisLess = [&centers](uint32_t first, uint32_t second)->bool
+	{
+		if (centers[first] != centers[second])
+			return centers[first] < centers[second];
+		return first < second;
+	};
+	int last = count - 1;
+	parallelNthElement(*pool, order, buffers.scratch, 0, last / 2, last, axisLess);
 
-	// find the median point on the more spreaded axis and the edges of the child lists
-	int sum = from + to;
-	int leftFrom = from;
-	int rightTo = to;
-	int leftTo = sum / 2;
-	int rightFrom = leftTo + 1;
-	if (sum % 2 == 1) {
-		if (currentNode->splitPlane == 'x')
-			currentNode->splitPos = (triangles[sum / 2].getCenterX() + triangles[sum / 2 + 1].getCenterX()) / 2;
-		else if(currentNode->splitPlane == 'y')
-			currentNode->splitPos = (triangles[sum / 2].getCenterY() + triangles[sum / 2 + 1].getCenterY()) / 2;
-		else if (currentNode->splitPlane == 'z')
-			currentNode->splitPos = (triangles[sum / 2].getCenterZ() + triangles[sum / 2 + 1].getCenterZ()) / 2;
-
-		//std::cout << currentNode.splitPlane << " " << currentNode.splitPos << std::endl;
-		//std::cout << leftFrom << " " << leftTo << " " << rightFrom << " " << rightTo << std::endl;
+	// find the median point on the more spreaded axis
+	float splitPos;
+	if (last % 2 == 1) {
+		// the upper median is the smallest element of the right half
+		uint32_t upper = *std::min_element(order.begin() + last / 2 + 1, order.end(), axisLess);
+		splitPos = (centers[order[last / 2]] + centers[upper]) / 2;
 	}
 	else {
-		if (currentNode->splitPlane == 'x')
-			currentNode->splitPos = (triangles[sum / 2].getCenterX());
-		else if (currentNode->splitPlane == 'y')
-			currentNode->splitPos = (triangles[sum / 2].getCenterY());
-		else if (currentNode->splitPlane == 'z')
-			currentNode->splitPos = (triangles[sum / 2].getCenterZ());
+		splitPos = centers[order[last / 2]];
+	}
 
-		currentNode->contents = &triangles[sum / 2];
-		leftTo = sum / 2 - 1;
-		rightFrom = sum / 2 + 1;
+	glm::vec3 leftMax = voxelMax;
+	glm::vec3 rightMin = voxelMin;
+	leftMax[axis] = splitPos;
+	rightMin[axis] = splitPos;
+	if (buffers.references.size() < buffers.referencesUsed + 2)
+		buffers.references.resize(buffers.referencesUsed + 2);
+	BoundsSoA& leftRefs = buffers.references[buffers.referencesUsed];
+	BoundsSoA& rightRefs = buffers.references[buffers.referencesUsed + 1];
+	leftRefs.clear();
+	rightRefs.clear();
+	if (splitPos > voxelMin[axis] && splitPos < voxelMax[axis])
+		splitReferences(refs, axis, splitPos, voxelMin, voxelMax, leftRefs, rightRefs);
 
-		//std::cout << currentNode.splitPlane << " " << currentNode.splitPos << " "<< sum/2 << std::endl;
-		//std::cout << leftFrom << " " << leftTo << " " << rightFrom << " " << rightTo << std::endl;
+	// a plane that cuts through everything does not make progress, more splits would only duplicate references
+	if (leftRefs.size() + rightRefs.size() == 0 || (leftRefs.size() == refs.size() && rightRefs.size() == refs.size())) {
+		out.nodes[node] = Node::leaf((uint32_t)out.indices.size(), (uint32_t)count);
+		out.indices.insert(out.indices.end(), refs.triangle.begin(), refs.triangle.end());
+		return;
 	}
 
-	//std::cout << "----------------------" << std::endl;
+	// create the new child nodes and call SortTriangles recursively on both sides
+	uint32_t leftChild = (uint32_t)out.nodes.size();
+	out.nodes.resize(out.nodes.size() + 2);
+	out.nodes[node] = Node::interior(axis, splitPos, leftChild);
 
-	// call create new childNodes and call SortTriangles recursively using them and the new boundaries in the list
-	Node* leftChild = new Node();
-	Node* rightChild = new Node();
-	currentNode->leftChild = leftChild;
-	currentNode->rightChild = rightChild;
+	// both sides have their own lists, so another thread can build the left side meanwhile
+	// the children and the tasks this thread runs while it waits for the left side take the lists above them
+	buffers.referencesUsed += 2;
+	splitChildren(out, leftChild, pool->size() > 1 && count >= PARALLEL_TASK_SIZE,
+		[&](uint32_t child, BuildOutput& childOut) { SortTriangles(leftRefs, voxelMin, leftMax, child, depth - 1, childOut); },
+		[&](uint32_t child, BuildOutput& childOut) { SortTriangles(rightRefs, rightMin, voxelMax, child, depth - 1, childOut); });
+	buffers.referencesUsed -= 2;
+}
 
-	// we need to create new vectors because SortTriangles will change the order
-	std::vector<Triangle>*  leftList = new std::vector<Triangle>();
-	std::vector<Triangle>* rightList = new std::vector<Triangle>();
-	for (int i = leftFrom; i <= leftTo; i++) {
-		leftList->push_back(triangles[i]);
+// builds the tree with the surface area heuristic
+// the events of all three axes are sorted once, afterwards every node only sweeps and splits its already sorted list
+// which keeps the whole build in O(N log N)
+void KDTree::BuildSAH(BoundsSoA& refs, const glm::vec3& voxelMin, const glm::vec3& voxelMax, int depth, BuildOutput& out) const {
+	int count = (int)refs.size();
+	std::vector<SplitEvent> events;
+	events.reserve(refs.size() * 6);
+	for (size_t i = 0; i < refs.size(); i++) {
+		glm::vec3 refMin(refs.min[0][i], refs.min[1][i], refs.min[2][i]);
+		glm::vec3 refMax(refs.max[0][i], refs.max[1][i], refs.max[2][i]);
+		addEvents(events, (int)refs.triangle[i], refMin, refMax);
 	}
+	refs = BoundsSoA();
+	pool->parallelSort(events, eventLess);
 
-	for (int i = rightFrom; i <= rightTo; i++) {
-		rightList->push_back(triangles[i]);
+	// every side is written before it is read, so a lazy tree keeps the lists for its next expansion
+	if (triangleSides.size() < pool->size() || triangleSides[0].size() != triangleCount)
+		triangleSides.assign(pool->size(), std::vector<char>(triangleCount));
+	SplitSAH(events, count, voxelMin, voxelMax, 0, depth, out);
+	if (!settings.lazy) {
+		triangleSides.clear();
+		triangleSides.shrink_to_fit();
 	}
+}
 
-	// start with the left side
-	SortTriangles(*leftList, 0, leftList->size() - 1, leftChild);
+void KDTree::SplitSAH(std::vector<SplitEvent>& events, int count, const glm::vec3& voxelMin, const glm::vec3& voxelMax, uint32_t node, int depth, BuildOutput& out) const {
+	if (count <= std::max(settings.maxLeafSize, 1) || depth == 0 || halfArea(voxelMin, voxelMax) <= 0.0f) {
+		makeLeafSAH(events, node, out);
+		return;
+	}
+
+	// sweep over the sorted events and count how many triangles lie left, right and on each candidate plane
+	int countLeft[3] = { 0, 0, 0 };
+	int countPlanar[3] = { 0, 0, 0 };
+	int countRight[3] = { count, count, count };
+	float bestCost = FLT_MAX;
+	float bestPos = 0.0f;
+	int bestAxis = -1;
+	bool bestPlanarLeft = true;
+	for (size_t i = 0; i < events.size();) {
+		int axis = events[i].axis;
+		float pos = events[i].pos;
+		int ending = 0, planar = 0, starting = 0;
+		while (i < events.size() && events[i].axis == axis && events[i].pos == pos && events[i].type == END) {
+			ending++;
+			i++;
+		}
+		while (i < events.size() && events[i].axis == axis && events[i].pos == pos && events[i].type == PLANAR) {
+			planar++;
+			i++;
+		}
+		while (i < events.size() && events[i].axis == axis && events[i].pos == pos && events[i].type == START) {
+			starting++;
+			i++;
+		}
+
+		countPlanar[axis] = planar;
+		countRight[axis] -= planar + ending;
 
-	// then make the right side
-	SortTriangles(*rightList, 0, rightList->size() - 1, rightChild);
+		// planes on the voxel border would only create an empty child without any volume
+		if (pos > voxelMin[axis] && pos < voxelMax[axis]) {
+			// the triangles lying in the plane go to whichever side is cheaper
+			float costLeft = costSAH(voxelMin, voxelMax, axis, pos, countLeft[axis] + countPlanar[axis], countRight[axis]);
+			float costRight = costSAH(voxelMin, voxelMax, axis, pos, countLeft[axis], countRight[axis] + countPlanar[axis]);
+			if (costLeft < bestCost || costRight < bestCost) {
+				bestAxis = axis;
+				bestPos = pos;
+				bestPlanarLeft = costLeft <= costRight;
+				bestCost = std::min(costLeft, costRight);
+			}
+		}
+
+		countLeft[axis] += starting + planar;
+		countPlanar[axis] = 0;
+	}
+
+	// stop if splitting is more expensive than intersecting everything in this node
+	if (bestAxis < 0 || bestCost >= settings.intersectionCost * count) {
+		makeLeafSAH(events, node, out);
+		return;
+	}
+
+	// classify the triangles, every triangle touching the plane is referenced by both children
+	// every triangle is written by exactly one event in each pass, so large lists can be split across the threads
+	std::vector<char>& triangleSide = triangleSides[pool->index()];
+	size_t grainSize = PARALLEL_PARTITION_SIZE / 4;
+	pool->parallelFor(events.size(), grainSize, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			if (events[i].axis == 0 && events[i].type != END)
+				triangleSide[events[i].triangle] = BOTH;
+		}
+	});
+	pool->parallelFor(events.size(), grainSize, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			const SplitEvent& e = events[i];
+			if (e.axis != bestAxis)
+				continue;
+			if (e.type == END && e.pos <= bestPos)
+				triangleSide[e.triangle] = LEFT;
+			else if (e.type == START && e.pos >= bestPos)
+				triangleSide[e.triangle] = RIGHT;
+			else if (e.type == PLANAR) {
+				if (e.pos < bestPos || (e.pos == bestPos && bestPlanarLeft))
+					triangleSide[e.triangle] = LEFT;
+				else
+					triangleSide[e.triangle] = RIGHT;
+			}
+		}
+	});
+
+	glm::vec3 leftMax = voxelMax;
+	glm::vec3 rightMin = voxelMin;
+	leftMax[bestAxis] = bestPos;
+	rightMin[bestAxis] = bestPos;
+
+	// the events of triangles that lie on one side only stay sorted when we move them over
+	// the straddling triangles get new events clipped to the child voxel, these are sorted separately and merged in
+	// each chunk of the list counts its events first, the prefix sums then give every chunk its place in the child lists
+	size_t chunkCount = events.size() >= PARALLEL_PARTITION_SIZE ? pool->size() * 4 : 1;
+	size_t chunkSize = (events.size() + chunkCount - 1) / chunkCount;
+	std::vector<size_t> leftOffset(chunkCount + 1, 0), rightOffset(chunkCount + 1, 0);
+	std::vector<int> leftCounts(chunkCount, 0), rightCounts(chunkCount, 0);
+	std::vector<std::vector<SplitEvent>> leftClipped(chunkCount), rightClipped(chunkCount);
+	pool->parallelFor(chunkCount, 1, [&](size_t begin, size_t end) {
+		for (size_t chunk = begin; chunk < end; chunk++) {
+			size_t last = std::min((chunk + 1) * chunkSize, events.size());
+			for (size_t i = chunk * chunkSize; i < last; i++) {
+				const SplitEvent& e = events[i];
+				char side = triangleSide[e.triangle];
+				if (side == LEFT)
+					leftOffset[chunk + 1]++;
+				else if (side == RIGHT)
+					rightOffset[chunk + 1]++;
+
+				if (e.axis == 0 && e.type != END) {
+					if (side == BOTH) {
+						// with exact clipping a triangle whose bounds cross the plane may still lie on one side only
+						glm::vec3 clipMin, clipMax;
+						if (clippedBounds((uint32_t)e.triangle, voxelMin, leftMax, clipMin, clipMax)) {
+							addEvents(leftClipped[chunk], e.triangle, clipMin, clipMax);
+							leftCounts[chunk]++;
+						}
+						if (clippedBounds((uint32_t)e.triangle, rightMin, voxelMax, clipMin, clipMax)) {
+							addEvents(rightClipped[chunk], e.triangle, clipMin, clipMax);
+							rightCounts[chunk]++;
+						}
+					}
+					else if (side == LEFT) {
+						leftCounts[chunk]++;
+					}
+					else {
+						rightCounts[chunk]++;
+					}
+				}
+			}
+		}
+	});
+	int leftCount = 0, rightCount = 0;
+	std::vector<SplitEvent> leftStraddling, rightStraddling;
+	for (size_t chunk = 0; chunk < chunkCount; chunk++) {
+		leftOffset[chunk + 1] += leftOffset[chunk];
+		rightOffset[chunk + 1] += rightOffset[chunk];
+		leftCount += leftCounts[chunk];
+		rightCount += rightCounts[chunk];
+		leftStraddling.insert(leftStraddling.end(), leftClipped[chunk].begin(), leftClipped[chunk].end());
+		rightStraddling.insert(rightStraddling.end(), rightClipped[chunk].begin(), rightClipped[chunk].end());
+	}
+	std::vector<std::vector<SplitEvent>>().swap(leftClipped);
+	std::vector<std::vector<SplitEvent>>().swap(rightClipped);
+
+	std::vector<SplitEvent> leftEvents(leftOffset[chunkCount]), rightEvents(rightOffset[chunkCount]);
+	pool->parallelFor(chunkCount, 1, [&](size_t begin, size_t end) {
+		for (size_t chunk = begin; chunk < end; chunk++) {
+			size_t leftPos = leftOffset[chunk];
+			size_t rightPos = rightOffset[chunk];
+			size_t last = std::min((chunk + 1) * chunkSize, events.size());
+			for (size_t i = chunk * chunkSize; i < last; i++) {
+				char side = triangleSide[events[i].triangle];
+				if (side == LEFT)
+					leftEvents[leftPos++] = events[i];
+				else if (side == RIGHT)
+					rightEvents[rightPos++] = events[i];
+			}
+		}
+	});
+
+	std::sort(leftStraddling.begin(), leftStraddling.end(), eventLess);
+	std::sort(rightStraddling.begin(), rightStraddling.end(), eventLess);
+	std::vector<SplitEvent> merged(leftEvents.size() + leftStraddling.size());
+	std::merge(leftEvents.begin(), leftEvents.end(), leftStraddling.begin(), leftStraddling.end(), merged.begin(), eventLess);
+	leftEvents.swap(merged);
+	merged = std::vector<SplitEvent>(rightEvents.size() + rightStraddling.size());
+	std::merge(rightEvents.begin(), rightEvents.end(), rightStraddling.begin(), rightStraddling.end(), merged.begin(), eventLess);
+	rightEvents.swap(merged);
+
+	// the events of this node are not needed anymore
+	std::vector<SplitEvent>().swap(events);
+	std::vector<SplitEvent>().swap(merged);
+	std::vector<SplitEvent>().swap(leftStraddling);
+	std::vector<SplitEvent>().swap(rightStraddling);
+
+	uint32_t leftChild = (uint32_t)out.nodes.size();
+	out.nodes.resize(out.nodes.size() + 2);
+	out.nodes[node] = Node::interior(bestAxis, bestPos, leftChild);
+	splitChildren(out, leftChild, pool->size() > 1 && count >= PARALLEL_TASK_SIZE,
+		[&](uint32_t child, BuildOutput& childOut) { SplitSAH(leftEvents, leftCount, voxelMin, leftMax, child, depth - 1, childOut); },
+		[&](uint32_t child, BuildOutput& childOut) { SplitSAH(rightEvents, rightCount, rightMin, voxelMax, child, depth - 1, childOut); });
 }
 
-Triangle* KDTree::searchHit(const float* point, const float* direction, float tmax){
-	return visitNodes(root, point, direction, tmax);
+// turns the node into a leaf referencing every triangle that still has events in this voxel
+void KDTree::makeLeafSAH(const std::vector<SplitEvent>& events, uint32_t node, BuildOutput& out) const {
+	uint32_t first = (uint32_t)out.indices.size();
+	for (const SplitEvent& e : events) {
+		if (e.axis == 0 && e.type != END)
+			out.indices.push_back((uint32_t)e.triangle);
+	}
+	out.nodes[node] = Node::leaf(first, (uint32_t)out.indices.size() - first);
 }
 
-Triangle* KDTree::visitNodes(Node* pNode, const float* point, const float* direction, float tmax) {
+// builds the tree with the surface area heuristic evaluated at a fixed number of planes per axis
+// the references of every node are kept as separate coordinate arrays, so bounds and bins are computed four at a time
+void KDTree::SplitBinned(BoundsSoA& refs, const glm::vec3& voxelMin, const glm::vec3& voxelMax, uint32_t node, int depth, BuildOutput& out) const {
+	int count = (int)refs.size();
+	if (count > std::max(settings.maxLeafSize, 1) && depth > 0 && halfArea(voxelMin, voxelMax) > 0.0f) {
+		// the bins only span the part of the voxel that is covered by triangles
+		// so the planes on the border of the bins cut off the empty space
+		glm::vec3 refsMin, refsMax;
+		for (int axis = 0; axis < 3; axis++) {
+			minMaxOf(refs.min[axis].data(), refs.max[axis].data(), refs.size(), refsMin[axis], refsMax[axis]);
+		}
+		refsMin = glm::max(refsMin, voxelMin);
+		refsMax = glm::min(refsMax, voxelMax);
+
+		// plane i lies between bin i - 1 and bin i, the triangles starting in a bin before it are left of it
+		// and the ones ending in the bin after it or later are right of it
+		// small nodes do not need the full resolution
+		int binCount = std::max(std::min(settings.bins, 4 * count), 1);
+		std::vector<int> starts(binCount), ends(binCount);
+		float bestCost = FLT_MAX;
+		float bestPos = 0.0f;
+		int bestAxis = -1;
+		for (int axis = 0; axis < 3; axis++) {
+			float extent = refsMax[axis] - refsMin[axis];
+			if (extent <= 0.0f)
+				continue;
+			std::fill(starts.begin(), starts.end(), 0);
+			std::fill(ends.begin(), ends.end(), 0);
+			countBins(refs.min[axis].data(), refs.size(), refsMin[axis], binCount / extent, binCount, starts.data());
+			countBins(refs.max[axis].data(), refs.size(), refsMin[axis], binCount / extent, binCount, ends.data());
 
-	// we have to check if there are contents saved in this node
-	if (pNode->contents != nullptr) {
-		// if there are contents saved in this node call the funciton to test if it hit with the actual geometry
-		// TODO add this function
-		glm::vec3 originFunk = glm::vec3(point[0],point[1], point[2]);
-		glm::vec3 dirFunk = glm::vec3(direction[0], direction[1], direction[2]);
-		glm::vec3 output;
-		if (testIntersection(*(pNode->contents), originFunk, dirFunk, output)) {
-			//std::cout << "hit triangle " << output.x << " " << output.y << " " << output.z << std::endl;
-			lastPoint = output;
-			return pNode->contents;
+			int countLeft = 0, countRight = count;
+			for (int i = 0; i <= binCount; i++) {
+				if (i > 0) {
+					countLeft += starts[i - 1];
+					countRight -= ends[i - 1];
+				}
+				float pos = refsMin[axis] + extent * i / binCount;
+				if (pos <= voxelMin[axis] || pos >= voxelMax[axis])
+					continue;
+				float cost = costSAH(voxelMin, voxelMax, axis, pos, countLeft, countRight);
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestPos = pos;
+					bestAxis = axis;
+				}
+			}
 		}
+
+		if (bestAxis >= 0 && bestCost < settings.intersectionCost * count) {
+			glm::vec3 leftMax = voxelMax;
+			glm::vec3 rightMin = voxelMin;
+			leftMax[bestAxis] = bestPos;
+			rightMin[bestAxis] = bestPos;
+
+			BoundsSoA leftRefs, rightRefs;
+			splitReferences(refs, bestAxis, bestPos, voxelMin, voxelMax, leftRefs, rightRefs);
+			refs = BoundsSoA();
+
+			uint32_t leftChild = (uint32_t)out.nodes.size();
+			out.nodes.resize(out.nodes.size() + 2);
+			out.nodes[node] = Node::interior(bestAxis, bestPos, leftChild);
+			splitChildren(out, leftChild, pool->size() > 1 && count >= PARALLEL_TASK_SIZE,
+				[&](uint32_t child, BuildOutput& childOut) { SplitBinned(leftRefs, voxelMin, leftMax, child, depth - 1, childOut); },
+				[&](uint32_t child, BuildOutput& childOut) { SplitBinned(rightRefs, rightMin, voxelMax, child, depth - 1, childOut); });
+			return;
+		}
+	}
+
+	// nothing worth splitting, the node becomes a leaf
+	out.nodes[node] = Node::leaf((uint32_t)out.indices.size(), (uint32_t)count);
+	out.indices.insert(out.indices.end(), refs.triangle.begin(), refs.triangle.end());
+}
+
+// builds both children of a node, the right child always follows the left one
+// large subtrees are built by another thread into their own output, appending both in order afterwards
+// gives the same node array and index list as a serial build
+void KDTree::splitChildren(BuildOutput& out, uint32_t leftChild, bool parallel, const std::function<void(uint32_t, BuildOutput&)>& buildLeft, const std::function<void(uint32_t, BuildOutput&)>& buildRight) const {
+	if (!parallel) {
+		buildLeft(leftChild, out);
+		buildRight(leftChild + 1, out);
+		return;
+	}
+
+	BuildOutput leftOut, rightOut;
+	leftOut.nodes.resize(1);
+	rightOut.nodes.resize(1);
+	ThreadPool::TaskGroup group;
+	pool->run(group, [&]() { buildLeft(0, leftOut); });
+	buildRight(0, rightOut);
+	pool->wait(group);
+	appendSubtree(out, leftChild, leftOut);
+	appendSubtree(out, leftChild + 1, rightOut);
+}
+
+// copies a subtree that was built into its own output, its root replaces the given node
+void KDTree::appendSubtree(BuildOutput& out, uint32_t node, const BuildOutput& subtree) {
+	// the nodes after the subtree root are appended, so their local index i ends up at nodeBase + i
+	uint32_t nodeBase = (uint32_t)out.nodes.size() - 1;
+	uint32_t indexOffset = (uint32_t)out.indices.size();
+	out.nodes[node] = subtree.nodes[0].relocated(nodeBase, indexOffset);
+	for (size_t i = 1; i < subtree.nodes.size(); i++) {
+		out.nodes.push_back(subtree.nodes[i].relocated(nodeBase, indexOffset));
+	}
+	out.indices.insert(out.indices.end(), subtree.indices.begin(), subtree.indices.end());
+}
+
+// copies the nodes that can be reached from the root with their leaf lists and built costs
+void KDTree::compactTree(const BuildOutput& tree, const std::vector<float>& built, BuildOutput& out, std::vector<float>& outBuilt) {
+	out.nodes.assign(1, Node());
+	out.indices.clear();
+	out.indices.reserve(tree.indices.size());
+	outBuilt.assign(1, built[0]);
+	// the node of the tree and the slot of its copy
+	std::vector<std::pair<uint32_t, uint32_t>> stack(1, std::make_pair(0u, 0u));
+	while (!stack.empty()) {
+		uint32_t node = stack.back().first;
+		uint32_t slot = stack.back().second;
+		stack.pop_back();
+		const Node& current = tree.nodes[node];
+		if (current.isLeaf()) {
+			uint32_t first = (uint32_t)out.indices.size();
+			out.indices.insert(out.indices.end(), tree.indices.begin() + current.firstTriangle(), tree.indices.begin() + current.firstTriangle() + current.triangleCount());
+			out.nodes[slot] = current.isPending() ? Node::pending(first, current.triangleCount()) : Node::leaf(first, current.triangleCount());
+			continue;
+		}
+		uint32_t leftChild = (uint32_t)out.nodes.size();
+		out.nodes.resize(leftChild + 2);
+		outBuilt.push_back(built[current.leftChild()]);
+		outBuilt.push_back(built[current.rightChild()]);
+		out.nodes[slot] = Node::interior(current.axis(), current.split(), leftChild);
+		stack.push_back(std::make_pair(current.rightChild(), leftChild + 1));
+		stack.push_back(std::make_pair(current.leftChild(), leftChild));
+	}
+}
+
+// distributes the references of a node to its children
+// triangles crossing the plane are referenced by both children, with their bounds clipped to the child voxel
+void KDTree::splitReferences(const BoundsSoA& refs, int axis, float pos, const glm::vec3& voxelMin, const glm::vec3& voxelMax, BoundsSoA& leftRefs, BoundsSoA& rightRefs) const {
+	glm::vec3 leftMax = voxelMax;
+	glm::vec3 rightMin = voxelMin;
+	leftMax[axis] = pos;
+	rightMin[axis] = pos;
+	leftRefs.reserve(refs.size());
+	rightRefs.reserve(refs.size());
+	for (size_t i = 0; i < refs.size(); i++) {
+		glm::vec3 refMin(refs.min[0][i], refs.min[1][i], refs.min[2][i]);
+		glm::vec3 refMax(refs.max[0][i], refs.max[1][i], refs.max[2][i]);
+		if (refMax[axis] <= pos) {
+			leftRefs.add(refs.triangle[i], refMin, refMax);
+		}
+		else if (refMin[axis] >= pos) {
+			rightRefs.add(refs.triangle[i], refMin, refMax);
+		}
+		else {
+			glm::vec3 clipMin, clipMax;
+			if (clippedBounds(refs.triangle[i], voxelMin, leftMax, clipMin, clipMax))
+				leftRefs.add(refs.triangle[i], clipMin, clipMax);
+			if (clippedBounds(refs.triangle[i], rightMin, voxelMax, clipMin, clipMax))
+				rightRefs.add(refs.triangle[i], clipMin, clipMax);
+		}
+	}
+}
+
+// bounds of the part of a triangle inside a voxel, false if nothing of it is left
+// without exact clipping this is the overlap of the triangle's bounds and the voxel, which is never empty for a straddling triangle
+bool KDTree::clippedBounds(uint32_t triangle, const glm::vec3& voxelMin, const glm::vec3& voxelMax, glm::vec3& clipMin, glm::vec3& clipMax) const {
+	const Triangle& t = triangleData[triangle];
+	if (settings.exactClipping)
+		return clipTriangle(t, voxelMin, voxelMax, clipMin, clipMax);
+	clipMin = glm::max(t.getMin(), voxelMin);
+	clipMax = glm::min(t.getMax(), voxelMax);
+	return clipMin.x <= clipMax.x && clipMin.y <= clipMax.y && clipMin.z <= clipMax.z;
+}
+
+void KDTree::BoundsSoA::clear() {
+	for (int axis = 0; axis < 3; axis++) {
+		min[axis].clear();
+		max[axis].clear();
 	}
+	triangle.clear();
+}
+
+void KDTree::BoundsSoA::reserve(size_t count) {
+	for (int axis = 0; axis < 3; axis++) {
+		min[axis].reserve(count);
+		max[axis].reserve(count);
+	}
+	triangle.reserve(count);
+}
+
+void KDTree::BoundsSoA::add(uint32_t index, const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+	for (int axis = 0; axis < 3; axis++) {
+		min[axis].push_back(boundsMin[axis]);
+		max[axis].push_back(boundsMax[axis]);
+	}
+	triangle.push_back(index);
+}
+
+// expected cost of a split, the child areas relative to the parent area are the probabilities that a ray visits them
+float KDTree::costSAH(const glm::vec3& voxelMin, const glm::vec3& voxelMax, int axis, float pos, int countLeft, int countRight) const {
+	glm::vec3 leftMax = voxelMax;
+	glm::vec3 rightMin = voxelMin;
+	leftMax[axis] = pos;
+	rightMin[axis] = pos;
+	float area = halfArea(voxelMin, voxelMax);
+	float probLeft = halfArea(voxelMin, leftMax) / area;
+	float probRight = halfArea(rightMin, voxelMax) / area;
+	float cost = settings.traversalCost + settings.intersectionCost * (probLeft * countLeft + probRight * countRight);
+	// favour cutting off empty space
+	if (countLeft == 0 || countRight == 0)
+		cost *= 0.8f;
+	return cost;
+}
+
+// order of the event list: by position, then axis, then type
+// the triangle index makes the order total, so every sorting algorithm produces the same list
+bool KDTree::eventLess(const SplitEvent& first, const SplitEvent& second) {
+	if (first.pos != second.pos)
+		return first.pos < second.pos;
+	if (first.axis != second.axis)
+		return first.axis < second.axis;
+	if (first.type != second.type)
+		return first.type < second.type;
+	return first.triangle < second.triangle;
+}
 
-	// if it does not have children, return
-	if (pNode->leftChild == nullptr && pNode->rightChild == nullptr)
+// adds the events of one triangle with the given (possibly clipped) bounds
+void KDTree::addEvents(std::vector<SplitEvent>& events, int triangle, const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+	for (char axis = 0; axis < 3; axis++) {
+		if (boundsMin[axis] == boundsMax[axis]) {
+			events.push_back({ boundsMin[axis], triangle, axis, PLANAR });
+		}
+		else {
+			events.push_back({ boundsMin[axis], triangle, axis, START });
+			events.push_back({ boundsMax[axis], triangle, axis, END });
+		}
+	}
+}
+
+Triangle* KDTree::findHit(const float* point, const float* direction, float tmax, TriangleHit& hit, TraversalContext& context) const {
+	if (!lazy) {
+		if (nodes.empty())
+			return nullptr;
+		return visitNodes(point, direction, tmax, hit, context);
+	}
+	std::shared_lock<std::shared_timed_mutex> reading(lazy->nodeLock);
+	if (nodes.empty())
 		return nullptr;
+	return visitNodes(point, direction, tmax, hit, context);
+}
 
-	// we need to find which child we need to go inside first
-	char dimension = pNode->splitPlane - 120; // minus 120 to get the 0, 1 or 2 from the ASCII value from x, y and z
-	bool smallerFirst = point[dimension] < pNode->splitPos;
+// walks the leaves along the ray front to back, every node is entered with the interval [tnear, tfar] of the ray inside it
+// the far child of a node the ray crosses into waits on the stack with its own interval, so the ray itself never moves
+// the closest hit in [0, best] is kept, once it lies inside the interval of the current leaf no later leaf can beat it
+// the waiting nodes and their intervals are kept in the stack of the context
+Triangle* KDTree::visitNodes(const float* point, const float* direction, float tmax, TriangleHit& hit, TraversalContext& context) const {
+	glm::vec3 origin(point[0], point[1], point[2]);
+	glm::vec3 dir(direction[0], direction[1], direction[2]);
+	glm::vec3 inverse(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+	WatertightRay ray(origin, dir);
 
-	// test if the ray was parallel to this plane (very unprobable)
-	if (direction[dimension] == 0.0f) {
-		// return if a hit will be found in only the first child
-		if (smallerFirst)
-			return visitNodes(pNode->leftChild, point, direction, tmax);
-		else
-			return visitNodes(pNode->rightChild, point, direction, tmax);
+	// the part of the ray outside of the bounds of the root can not hit anything
+	float tnear, tfar;
+	if (!clipRay(fittedMin(0), fittedMax(0), origin, inverse, tmax, tnear, tfar))
+		return nullptr;
+	Mailbox& mailbox = context.mailboxes[0];
+	mailbox.clear();
+
+	Triangle* result = nullptr;
+	TriangleHit resultHit;
+	float best = tmax;
+	uint32_t* stackNode = context.node + context.base;
+	float* stackNear = context.entry + context.base;
+	float* stackFar = context.exit + context.base;
+	int stackSize = 0;
+	uint32_t node = 0;
+	while (true) {
+		// a copy, the arrays of a lazy tree may move while a node is expanded
+		Node current = nodes[node];
+		if (current.isPending() && lazy) {
+			// splitting a node doesn't change the answer of any query, the lazy state serialises it against the other queries
+			expandNode(node);
+			current = nodes[node];
+		}
+
+		if (!current.isLeaf()) {
+			// the child on the side of the origin comes first, a ray inside the plane goes to the side it points to
+			int axis = current.axis();
+			float splitPos = current.split();
+			bool leftFirst = origin[axis] < splitPos || (origin[axis] == splitPos && dir[axis] <= 0.0f);
+			uint32_t firstChild = leftFirst ? current.leftChild() : current.rightChild();
+			uint32_t secondChild = leftFirst ? current.rightChild() : current.leftChild();
+			float t = (splitPos - origin[axis]) * inverse[axis];
+
+			// the plane is behind the origin, beyond the interval or parallel to the ray (t is infinite or NaN)
+			if (!(t > 0.0f && t <= tfar)) {
+				node = firstChild;
+			}
+			// the ray crosses the plane before it enters the node
+			else if (t < tnear) {
+				node = secondChild;
+			}
+			else {
+				stackNode[stackSize] = secondChild;
+				stackNear[stackSize] = t;
+				stackFar[stackSize] = tfar;
+				stackSize++;
+				node = firstChild;
+				tfar = t;
+			}
+			continue;
+		}
+
+		int found = intersectTriangles(ray, records, triangleIndices.data(), current.firstTriangle(), current.triangleCount(), mailbox, best, resultHit);
+		if (found >= 0) {
+			best = resultHit.t;
+			result = &triangleData[triangleIndices[current.firstTriangle() + found]];
+		}
+		if (result != nullptr && best <= tfar)
+			break;
+
+		// nodes the ray only enters behind the closest hit are skipped
+		while (stackSize > 0 && stackNear[stackSize - 1] > best) {
+			stackSize--;
+		}
+		if (stackSize == 0)
+			break;
+		stackSize--;
+		node = stackNode[stackSize];
+		tnear = stackNear[stackSize];
+		tfar = stackFar[stackSize];
 	}
-	else {
-		// calculate the intersection t
-		float t = (pNode->splitPos - point[dimension]) / direction[dimension];
-
-		// if the calculated t is in the ray segment
-		if (0.0f <= t && t < tmax) {
-			// test first if something is found in the first child
-			Triangle* result;
-			if (smallerFirst)
-				result = visitNodes(pNode->leftChild, point, direction, t);
-			else
-				result = visitNodes(pNode->rightChild, point, direction, t);
 
-			// if something was found, return it without searching the second child
-			if (result != nullptr) {
-				return result;
+	if (result != nullptr)
+		hit = resultHit;
+	return result;
+}
+
+bool KDTree::occluded(const float* point, const float* direction, float tmax, TraversalContext& context) const {
+	if (!lazy) {
+		if (nodes.empty())
+			return false;
+		return visitOccluders(point, direction, tmax, context);
+	}
+	std::shared_lock<std::shared_timed_mutex> reading(lazy->nodeLock);
+	if (nodes.empty())
+		return false;
+	return visitOccluders(point, direction, tmax, context);
+}
+
+// the traversal of visitNodes without a closest hit, the first triangle hit anywhere in [0, tmax] ends it
+bool KDTree::visitOccluders(const float* point, const float* direction, float tmax, TraversalContext& context) const {
+	glm::vec3 origin(point[0], point[1], point[2]);
+	glm::vec3 dir(direction[0], direction[1], direction[2]);
+	glm::vec3 inverse(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+	WatertightRay ray(origin, dir);
+	float tnear, tfar;
+	if (!clipRay(fittedMin(0), fittedMax(0), origin, inverse, tmax, tnear, tfar))
+		return false;
+	Mailbox& mailbox = context.mailboxes[0];
+	mailbox.clear();
+
+	uint32_t* stackNode = context.node + context.base;
+	float* stackNear = context.entry + context.base;
+	float* stackFar = context.exit + context.base;
+	int stackSize = 0;
+	uint32_t node = 0;
+	while (true) {
+		Node current = nodes[node];
+		if (current.isPending() && lazy) {
+			expandNode(node);
+			current = nodes[node];
+		}
+
+		if (!current.isLeaf()) {
+			int axis = current.axis();
+			float splitPos = current.split();
+			bool leftFirst = origin[axis] < splitPos || (origin[axis] == splitPos && dir[axis] <= 0.0f);
+			uint32_t firstChild = leftFirst ? current.leftChild() : current.rightChild();
+			uint32_t secondChild = leftFirst ? current.rightChild() : current.leftChild();
+			float t = (splitPos - origin[axis]) * inverse[axis];
+			if (!(t > 0.0f && t <= tfar)) {
+				node = firstChild;
+			}
+			else if (t < tnear) {
+				node = secondChild;
 			}
 			else {
-				// visit the second child taking into account the new line segment (only the second part of the ray)
-				float newPoint[3] = { point[0] + t * direction[0], point[1] + t * direction[1] , point[2] + t * direction[2] };
-				if (smallerFirst)
-					return visitNodes(pNode->rightChild, newPoint, direction, tmax - t);
-				else
-					return visitNodes(pNode->leftChild, newPoint, direction, tmax - t);
+				stackNode[stackSize] = secondChild;
+				stackNear[stackSize] = t;
+				stackFar[stackSize] = tfar;
+				stackSize++;
+				node = firstChild;
+				tfar = t;
+			}
+			continue;
+		}
+
+		TriangleHit hit;
+		if (intersectTriangles(ray, records, triangleIndices.data(), current.firstTriangle(), current.triangleCount(), mailbox, tmax, hit) >= 0)
+			return true;
+
+		if (stackSize == 0)
+			return false;
+		stackSize--;
+		node = stackNode[stackSize];
+		tnear = stackNear[stackSize];
+		tfar = stackFar[stackSize];
+	}
+}
+
+void KDTree::searchPacket(int count, const glm::vec3* origins, const glm::vec3* directions, float tmax, Triangle** results, TriangleHit* hits, TraversalContext& context) const {
+	std::shared_lock<std::shared_timed_mutex> reading;
+	if (lazy)
+		reading = std::shared_lock<std::shared_timed_mutex>(lazy->nodeLock);
+	for (int first = 0; first < count; first += MAX_PACKET) {
+		int size = std::min(count - first, MAX_PACKET);
+		if (nodes.empty())
+			std::fill(results + first, results + first + size, nullptr);
+		else
+			visitPacket(size, origins + first, directions + first, tmax, results + first, hits + first, context);
+	}
+}
+
+// the traversal of visitNodes for up to MAX_PACKET rays at once, every ray keeps its own interval and closest hit
+// rays that run to the same side on every axis visit the children of a node in the same order, so the whole packet
+// takes one path through the tree and a node is only skipped once no ray of the packet enters it
+// packets whose directions differ in a sign are answered ray by ray
+// the waiting nodes take one entry of the context's node stack and MAX_PACKET entries of its interval stacks per level
+void KDTree::visitPacket(int count, const glm::vec3* origins, const glm::vec3* directions, float tmax, Triangle** results, TriangleHit* hits, TraversalContext& context) const {
+	// the lanes are filled up to a multiple of the SIMD width with rays that have an empty interval
+	int lanes = (count + 3) / 4 * 4;
+	PacketRays rays;
+	PacketEntry current;
+	float best[MAX_PACKET];	// closest hit of every ray so far, negative once no later leaf can beat it
+	bool negative[3];
+	for (int axis = 0; axis < 3; axis++) {
+		negative[axis] = std::signbit(1.0f / directions[0][axis]);
+	}
+	bool coherent = true;
+	for (int lane = 0; lane < lanes; lane++) {
+		if (lane >= count) {
+			for (int axis = 0; axis < 3; axis++) {
+				rays.origin[axis][lane] = 0.0f;
+				rays.inverse[axis][lane] = 0.0f;
+			}
+			current.tnear[lane] = 1.0f;
+			current.tfar[lane] = 0.0f;
+			best[lane] = -1.0f;
+			continue;
+		}
+		glm::vec3 inverse(1.0f / directions[lane].x, 1.0f / directions[lane].y, 1.0f / directions[lane].z);
+		for (int axis = 0; axis < 3; axis++) {
+			rays.origin[axis][lane] = origins[lane][axis];
+			rays.inverse[axis][lane] = inverse[axis];
+			coherent = coherent && std::signbit(inverse[axis]) == negative[axis];
+		}
+		clipRay(fittedMin(0), fittedMax(0), origins[lane], inverse, tmax, current.tnear[lane], current.tfar[lane]);
+		best[lane] = tmax;
+		results[lane] = nullptr;
+	}
+
+	if (!coherent) {
+		for (int lane = 0; lane < count; lane++) {
+			results[lane] = visitNodes(&origins[lane].x, &directions[lane].x, tmax, hits[lane], context);
+		}
+		return;
+	}
+
+	WatertightRay triangleRays[MAX_PACKET];
+	for (int lane = 0; lane < count; lane++) {
+		triangleRays[lane] = WatertightRay(origins[lane], directions[lane]);
+		context.mailboxes[lane].clear();
+	}
+	int searching = count;
+	uint32_t* stackNode = context.node + context.base;
+	float* stackNear = context.entry + context.base;
+	float* stackFar = context.exit + context.base;
+	int stackSize = 0;
+	current.node = 0;
+	bool active = true;
+	while (active) {
+		// a copy, the arrays of a lazy tree may move while a node is expanded
+		Node node = nodes[current.node];
+		if (node.isPending() && lazy) {
+			expandNode(current.node);
+			node = nodes[current.node];
+		}
+
+		if (!node.isLeaf()) {
+			// the near child is the side the rays come from
+			int axis = node.axis();
+			uint32_t nearChild = negative[axis] ? node.rightChild() : node.leftChild();
+			uint32_t farChild = negative[axis] ? node.leftChild() : node.rightChild();
+			alignas(32) float nearTfar[MAX_PACKET];
+			alignas(32) float farTnear[MAX_PACKET];
+			int sides = splitIntervals(rays.origin[axis], rays.inverse[axis], node.split(), lanes, current.tnear, current.tfar, nearTfar, farTnear);
+			if (sides == (NEAR_SIDE | FAR_SIDE)) {
+				stackNode[stackSize] = farChild;
+				std::copy(farTnear, farTnear + lanes, stackNear + stackSize * MAX_PACKET);
+				std::copy(current.tfar, current.tfar + lanes, stackFar + stackSize * MAX_PACKET);
+				stackSize++;
+			}
+			if (sides & NEAR_SIDE) {
+				current.node = nearChild;
+				std::copy(nearTfar, nearTfar + lanes, current.tfar);
+				continue;
+			}
+			if (sides & FAR_SIDE) {
+				current.node = farChild;
+				std::copy(farTnear, farTnear + lanes, current.tnear);
+				continue;
 			}
 		}
 		else {
-			// return if a hit will be found in only the first child
-			if (smallerFirst)
-				return visitNodes(pNode->leftChild, point, direction, tmax);
-			else
-				return visitNodes(pNode->rightChild, point, direction, tmax);
+			for (int lane = 0; lane < count; lane++) {
+				if (current.tnear[lane] > current.tfar[lane])
+					continue;
+				int found = intersectTriangles(triangleRays[lane], records, triangleIndices.data(), node.firstTriangle(), node.triangleCount(), context.mailboxes[lane], best[lane], hits[lane]);
+				if (found >= 0) {
+					best[lane] = hits[lane].t;
+					results[lane] = &triangleData[triangleIndices[node.firstTriangle() + found]];
+				}
+				if (results[lane] != nullptr && best[lane] <= current.tfar[lane]) {
+					best[lane] = -1.0f;
+					searching--;
+				}
+			}
+			if (searching == 0)
+				break;
+		}
+
+		// the next waiting node is only visited if a ray that is still searching enters it before its closest hit
+		active = false;
+		while (!active && stackSize > 0) {
+			stackSize--;
+			current.node = stackNode[stackSize];
+			for (int lane = 0; lane < lanes; lane++) {
+				current.tnear[lane] = stackNear[stackSize * MAX_PACKET + lane];
+				current.tfar[lane] = std::min(stackFar[stackSize * MAX_PACKET + lane], best[lane]);
+				active = active || current.tnear[lane] <= current.tfar[lane];
+			}
 		}
 	}
 }
 
-// method that tests if there exists an intersection between the ray and a triangle
-// returns true if hit, and the coordinates are stored int he intersecion reference
-bool KDTree::testIntersection(const Triangle& triangle, glm::vec3 origin, glm::vec3 direction, glm::vec3& intersection) {
-	// we calculate som working variables
-	const float eps = 0.0001f;
-	glm::vec3 edge1 = triangle.getCorner(1) - triangle.getCorner(0);
-	glm::vec3 edge2 = triangle.getCorner(2) - triangle.getCorner(0);
-	glm::vec3 normal = glm::cross(edge1, edge2);
-	glm::normalize(normal);
-	float d = glm::dot(-normal, triangle.getCorner(0));
-	float check = glm::dot(normal, direction);
+// walks the nodes whose bounds come within the squared distance limit of the point, the closer child first
+// visit gets every reference of a reached leaf with its centroid within the limit and may shrink the limit
+// a triangle's centroid lies on the triangle, so the bounds of the leaf whose voxel holds it hold the centroid as well,
+// a triangle crossing a split plane is passed once for every leaf that references it
+template <typename Visit>
+void KDTree::visitNeighbours(const glm::vec3& point, float& limit, TraversalContext& context, Visit visit) const {
+	float rootDistance;
+	if (nodes.empty() || !reachesNode(0, point, limit, rootDistance))
+		return;
+	uint32_t* stackNode = context.node + context.base;
+	float* stackDistance = context.entry + context.base;
+	int stackSize = 0;
+	uint32_t node = 0;
+	while (true) {
+		// a copy, the arrays of a lazy tree may move while a node is expanded
+		Node current = nodes[node];
+		if (current.isPending() && lazy) {
+			expandNode(node);
+			current = nodes[node];
+		}
+		if (!current.isLeaf()) {
+			uint32_t closer = current.leftChild();
+			uint32_t further = current.rightChild();
+			float closerDistance, furtherDistance;
+			bool reachCloser = reachesNode(closer, point, limit, closerDistance);
+			bool reachFurther = reachesNode(further, point, limit, furtherDistance);
+			if (reachCloser && reachFurther) {
+				if (furtherDistance < closerDistance) {
+					std::swap(closer, further);
+					std::swap(closerDistance, furtherDistance);
+				}
+				stackNode[stackSize] = further;
+				stackDistance[stackSize] = furtherDistance;
+				stackSize++;
+				node = closer;
+				continue;
+			}
+			if (reachCloser || reachFurther) {
+				node = reachCloser ? closer : further;
+				continue;
+			}
+		}
+		else {
+			for (uint32_t i = current.firstTriangle(); i < current.firstTriangle() + current.triangleCount(); i++) {
+				glm::vec3 offset = (records.corner(i, 0) + records.corner(i, 1) + records.corner(i, 2)) / 3.0f - point;
+				float distance = glm::dot(offset, offset);
+				if (distance <= limit)
+					visit(triangleIndices[i], distance);
+			}
+		}
+
+		// nodes that are further away than the neighbours found since they were pushed are skipped
+		while (stackSize > 0 && stackDistance[stackSize - 1] > limit) {
+			stackSize--;
+		}
+		if (stackSize == 0)
+			break;
+		stackSize--;
+		node = stackNode[stackSize];
+	}
+}
 
-	// it we are parallel to the triangle return false
-	if (std::abs(check) < eps) {
+// squared distance of the point from the bounds of the node, false if the node has no triangles or lies beyond the limit
+bool KDTree::reachesNode(uint32_t node, const glm::vec3& point, float limit, float& distance) const {
+	if (nodeMin[0][node] > nodeMax[0][node])
 		return false;
+	distance = squaredDistance(point, fittedMin(node), fittedMax(node));
+	return distance <= limit;
+}
+
+// the result is a max heap of the k closest neighbours so far, its top is the one to give up first
+// once it is full, its top bounds the distance of the nodes that are still worth visiting
+// a triangle referenced by several leaves is only added once, if it was dropped from the heap it can't be added again
+// because it is not closer than the top
+void KDTree::nearestTriangles(const glm::vec3& point, int k, float maxDistance, std::vector<Neighbour>& result, TraversalContext& context) const {
+	result.clear();
+	if (k <= 0)
+		return;
+	std::shared_lock<std::shared_timed_mutex> reading;
+	if (lazy)
+		reading = std::shared_lock<std::shared_timed_mutex>(lazy->nodeLock);
+
+	// a triangle referenced by several leaves is passed once per leaf, the set keeps every triangle that entered the heap
+	// an evicted triangle doesn't have to be removed from it, it is not closer than the heap's farthest from then on
+	float limit = maxDistance * maxDistance;
+	std::vector<uint32_t>& seen = context.triangles;
+	size_t seenCount = 0;
+	size_t tableSize = 16;
+	while (tableSize < 4 * (size_t)k)
+		tableSize *= 2;
+	seen.assign(tableSize, UINT32_MAX);
+	visitNeighbours(point, limit, context, [&](uint32_t triangle, float distance) {
+		Neighbour candidate = { triangle, distance };
+		bool full = result.size() == (size_t)k;
+		if (full && !neighbourLess(candidate, result.front()))
+			return;
+		if (!insertTriangle(seen, seenCount, triangle))
+			return;
+		if (full) {
+			std::pop_heap(result.begin(), result.end(), neighbourLess);
+			result.pop_back();
+		}
+		result.push_back(candidate);
+		std::push_heap(result.begin(), result.end(), neighbourLess);
+		if (result.size() == (size_t)k)
+			limit = result.front().distance;
+	});
+
+	std::sort_heap(result.begin(), result.end(), neighbourLess);
+	for (Neighbour& neighbour : result) {
+		neighbour.distance = std::sqrt(neighbour.distance);
 	}
-	// calculate the t that intersectc with the triangle plane
-	float t = -(glm::dot(normal, origin) + d) / check;
-	// save the point
-	intersection = origin + t * direction;
+}
 
-	// we will check if the point is inside the triangle
-	// we will add 1 to each side when the point is on that side
-	// if one side gets 3 or more points the point is inside the three planes
-	int sideA = 0;
-	int sideB = 0;
+// the radius never shrinks, the copies of triangles referenced by several leaves are removed after sorting
+void KDTree::trianglesInRadius(const glm::vec3& point, float radius, std::vector<Neighbour>& result, TraversalContext& context) const {
+	result.clear();
+	std::shared_lock<std::shared_timed_mutex> reading;
+	if (lazy)
+		reading = std::shared_lock<std::shared_timed_mutex>(lazy->nodeLock);
 
-	for (int i = 0; i < 3; i++) {
-		const glm::vec3& a = triangle.getCorner(i);
-		const glm::vec3& b = triangle.getCorner((i + 1) % 3);
-		const glm::vec3 c = triangle.getCorner(i) + normal;
-		float o = orient(a, b, c, intersection);
-		if (o < -eps) {
-			sideA++;
+	float limit = radius * radius;
+	visitNeighbours(point, limit, context, [&](uint32_t triangle, float distance) {
+		result.push_back({ triangle, distance });
+	});
+
+	std::sort(result.begin(), result.end(), neighbourLess);
+	result.erase(std::unique(result.begin(), result.end(), [](const Neighbour& first, const Neighbour& second) {
+		return first.triangle == second.triangle;
+	}), result.end());
+	for (Neighbour& neighbour : result) {
+		neighbour.distance = std::sqrt(neighbour.distance);
+	}
+}
+
+// the nodes are culled by the faces of the box, the triangles of the leaves it cuts are tested exactly
+void KDTree::trianglesInBox(const glm::vec3& boxMin, const glm::vec3& boxMax, std::vector<uint32_t>& result, TraversalContext& context) const {
+	glm::vec3 center = (boxMin + boxMax) * 0.5f;
+	glm::vec3 halfSize = (boxMax - boxMin) * 0.5f;
+	visitVolume(Frustum::fromBox(boxMin, boxMax), result, context, [&](uint32_t reference, uint32_t) {
+		return triangleOverlapsBox(center, halfSize, records.corner(reference, 0), records.corner(reference, 1), records.corner(reference, 2));
+	});
+}
+
+// a triangle is left out if its three corners lie outside of the same plane
+void KDTree::trianglesInFrustum(const Frustum& frustum, std::vector<uint32_t>& result, TraversalContext& context) const {
+	visitVolume(frustum, result, context, [&](uint32_t reference, uint32_t planes) {
+		for (int plane = 0; plane < 6; plane++) {
+			if ((planes & (1u << plane)) == 0)
+				continue;
+			const glm::vec4& p = frustum.planes[plane];
+			if (glm::dot(glm::vec3(p), records.corner(reference, 0)) + p.w < 0.0f
+				&& glm::dot(glm::vec3(p), records.corner(reference, 1)) + p.w < 0.0f
+				&& glm::dot(glm::vec3(p), records.corner(reference, 2)) + p.w < 0.0f)
+				return false;
+		}
+		return true;
+	});
+}
+
+// the nodes wait on the stack with the planes their parent doesn't lie inside of yet, a node inside of all planes is
+// inside the volume and its subtree is taken as it is
+// that needs exactly clipped references, without them a leaf may reference a triangle whose bounds reach into its voxel
+// while the triangle itself passes it by, so their references are still passed to overlaps
+// the references of the leaves the volume cuts are passed to overlaps with the planes that cut the leaf
+template <typename Overlaps>
+void KDTree::visitVolume(const Frustum& frustum, std::vector<uint32_t>& result, TraversalContext& context, Overlaps overlaps) const {
+	result.clear();
+	std::shared_lock<std::shared_timed_mutex> reading;
+	if (lazy)
+		reading = std::shared_lock<std::shared_timed_mutex>(lazy->nodeLock);
+	if (nodes.empty())
+		return;
+
+	uint32_t* stackNode = context.node + context.base;
+	uint32_t* stackPlanes = context.count + context.base;
+	int stackSize = 0;
+	stackNode[stackSize] = 0;
+	stackPlanes[stackSize] = ALL_PLANES;
+	stackSize++;
+	while (stackSize > 0) {
+		stackSize--;
+		uint32_t node = stackNode[stackSize];
+		uint32_t planes = stackPlanes[stackSize];
+		// a copy, the arrays of a lazy tree may move while a node is expanded
+		Node current = nodes[node];
+		if (planes != 0) {
+			if (nodeMin[0][node] > nodeMax[0][node] || !overlapsPlanes(frustum, fittedMin(node), fittedMax(node), planes))
+				continue;
+			// a pending node inside the frustum is taken whole, one that is cut by it is split first
+			if (current.isPending() && lazy && planes != 0) {
+				expandNode(node);
+				current = nodes[node];
+			}
+		}
+
+		if (!current.isLeaf()) {
+			stackNode[stackSize] = current.rightChild();
+			stackPlanes[stackSize] = planes;
+			stackNode[stackSize + 1] = current.leftChild();
+			stackPlanes[stackSize + 1] = planes;
+			stackSize += 2;
+			continue;
+		}
+		for (uint32_t i = current.firstTriangle(); i < current.firstTriangle() + current.triangleCount(); i++) {
+			if ((planes == 0 && settings.exactClipping) || overlaps(i, planes))
+				result.push_back(triangleIndices[i]);
+		}
+	}
+
+	// triangles crossing split planes are referenced by several leaves
+	// a long list is sorted faster by marking its triangles in a bit set over all triangles and reading it back in order,
+	// the set lives in the scratch of the context, so it keeps its memory between the queries of a thread
+	if (result.size() * SORT_DEDUPE_RATIO < triangleCount) {
+		std::sort(result.begin(), result.end());
+		result.erase(std::unique(result.begin(), result.end()), result.end());
+		return;
+	}
+	std::vector<uint32_t>& found = context.triangles;
+	found.assign((triangleCount + 31) / 32, 0);
+	for (uint32_t triangle : result) {
+		found[triangle / 32] |= 1u << (triangle % 32);
+	}
+	result.clear();
+	for (size_t word = 0; word < found.size(); word++) {
+		for (uint32_t bits = found[word]; bits != 0; bits &= bits - 1) {
+			result.push_back((uint32_t)(word * 32 + lowestBit(bits)));
 		}
-		else if (o > eps) {
-			sideB++;
+	}
+}
+
+void KDTree::nearestBatch(size_t count, const glm::vec3* points, int k, float maxDistance, NeighbourBuffer& result, const BatchSettings& batchSettings) const {
+	searchNeighbours(count, result, batchSettings, [&](size_t query, std::vector<Neighbour>& found, TraversalContext& context) {
+		nearestTriangles(points[query], k, maxDistance, found, context);
+	});
+}
+
+void KDTree::radiusBatch(size_t count, const glm::vec3* points, float radius, NeighbourBuffer& result, const BatchSettings& batchSettings) const {
+	searchNeighbours(count, result, batchSettings, [&](size_t query, std::vector<Neighbour>& found, TraversalContext& context) {
+		trianglesInRadius(points[query], radius, found, context);
+	});
+}
+
+// every chunk of queries collects its neighbours in its own list, the lists are copied behind each other once
+// the number of neighbours of every query is known
+void KDTree::searchNeighbours(size_t count, NeighbourBuffer& result, const BatchSettings& batchSettings, const std::function<void(size_t, std::vector<Neighbour>&, TraversalContext&)>& search) const {
+	result.first.assign(count + 1, 0);
+	std::unique_ptr<ThreadPool> ownPool;
+	ThreadPool& pool = batchPool(batchSettings, ownPool);
+	std::mutex partLock;
+	std::vector<std::pair<size_t, std::vector<Neighbour>>> parts;
+	pool.parallelFor(count, NEIGHBOUR_GRAIN, [&](size_t begin, size_t end) {
+		TraversalContext& context = threadContext();
+		std::vector<Neighbour> part, found;
+		for (size_t query = begin; query < end; query++) {
+			search(query, found, context);
+			result.first[query + 1] = found.size();
+			part.insert(part.end(), found.begin(), found.end());
+		}
+		std::lock_guard<std::mutex> adding(partLock);
+		parts.emplace_back(begin, std::move(part));
+	});
+
+	for (size_t query = 0; query < count; query++) {
+		result.first[query + 1] += result.first[query];
+	}
+	result.neighbours.resize(result.first[count]);
+	for (const auto& part : parts) {
+		std::copy(part.second.begin(), part.second.end(), result.neighbours.begin() + result.first[part.first]);
+	}
+}
+
+// expected cost of a ray through the scene according to the surface area heuristic
+// it does not depend on how the tree was built, so it compares the quality of the build modes
+float KDTree::expectedCost() const {
+	float area = halfArea(boundsMin, boundsMax);
+	if (nodes.empty() || area <= 0.0f)
+		return 0.0f;
+	return nodeCost(nodes.data(), 0, boundsMin, boundsMax, nullptr) / area;
+}
+
+AccelerationStats KDTree::stats() const {
+	AccelerationStats result;
+	result.nodes = nodes.size();
+	result.bytes = nodes.size() * sizeof(Node) + triangleIndices.size() * sizeof(uint32_t) + records.bytes();
+	result.expectedCost = expectedCost();
+	if (nodes.empty())
+		return result;
+	std::vector<std::pair<uint32_t, int>> stack(1, std::make_pair(0u, 0));
+	while (!stack.empty()) {
+		uint32_t node = stack.back().first;
+		int level = stack.back().second;
+		stack.pop_back();
+		const Node& current = nodes[node];
+		if (current.isLeaf()) {
+			result.leaves++;
+			result.references += current.triangleCount();
+			result.depth = std::max(result.depth, level);
 		}
 		else {
-			sideA++;
-			sideB++;
+			stack.push_back(std::make_pair(current.rightChild(), level + 1));
+			stack.push_back(std::make_pair(current.leftChild(), level + 1));
 		}
 	}
+	return result;
+}
 
-	if (sideA >= 3 || sideB >= 3) {
-		return true;
+// cost of a subtree weighted with the surface area of the nodes, which is proportional to the chance of a ray visiting them
+// the cost of every node of the subtree is written to costs if it is given
+float KDTree::nodeCost(const Node* tree, uint32_t node, const glm::vec3& voxelMin, const glm::vec3& voxelMax, float* costs) const {
+	float area = halfArea(voxelMin, voxelMax);
+	const Node& current = tree[node];
+	float cost;
+	if (current.isLeaf()) {
+		cost = area * settings.intersectionCost * current.triangleCount();
+	}
+	else {
+		int axis = current.axis();
+		float pos = glm::clamp(current.split(), voxelMin[axis], voxelMax[axis]);
+		glm::vec3 leftMax = voxelMax;
+		glm::vec3 rightMin = voxelMin;
+		leftMax[axis] = pos;
+		rightMin[axis] = pos;
+		cost = area * settings.traversalCost + nodeCost(tree, current.leftChild(), voxelMin, leftMax, costs) + nodeCost(tree, current.rightChild(), rightMin, voxelMax, costs);
 	}
-	return false;
+	if (costs != nullptr)
+		costs[node] = cost;
+	return cost;
 }
 
-// method to calculate if a point is above or below a plane
-float KDTree::orient(const glm::vec3& a, const  glm::vec3& b, const  glm::vec3& c, const  glm::vec3& d) {
-	return glm::dot((a - d), glm::cross((b - d), (c - d)));
+// deepest level the builders may create
+int KDTree::depthLimit() const {
+	if (settings.maxDepth > 0)
+		return std::min(settings.maxDepth, MAX_DEPTH);
+	return std::min(maxDepthFor(triangleCount), MAX_DEPTH);
 }
 
-void KDTree::fillBoxes(Node* pNode, float xMin, float xMax, float yMin, float yMax, float zMin, float zMax) {
-	// make and save this box
-	Box* thisBox = new Box(xMin, xMax, yMin, yMax, zMin, zMax);
-	boxes.push_back(*thisBox);
+// the planes stay where they are, the moved triangles are only taken out of their leaves
+// and inserted into the leaves their new bounds overlap
+// the tree is copied into the spare arena on the way, which keeps the leaf lists contiguous and the memory flat
+UpdateResult KDTree::update(const std::vector<uint32_t>& changed) {
+	if (nodes.empty())
+		return UpdateResult::Refit;
 
-	// has this node children?
-	if (pNode->splitPlane == 'o') {
-		// it has no children, return
+	// 1 marks a moved triangle, 2 one that was inserted already
+	std::vector<char> moved(triangleCount, 0);
+	for (uint32_t triangle : changed) {
+		moved[triangle] = 1;
+		boundsMin = glm::min(boundsMin, triangleData[triangle].getMin());
+		boundsMax = glm::max(boundsMax, triangleData[triangle].getMax());
+	}
+	std::unordered_map<uint32_t, std::vector<uint32_t>> added;
+	for (uint32_t triangle : changed) {
+		if (moved[triangle] == 2)
+			continue;
+		moved[triangle] = 2;
+		glm::vec3 refMin, refMax;
+		if (clippedBounds(triangle, boundsMin, boundsMax, refMin, refMax))
+			insertReference(0, triangle, refMin, refMax, boundsMin, boundsMax, added);
+	}
+
+	BuildOutput refit;
+	std::vector<float> built(1);
+	refit.nodes.resize(1);
+	refit.indices.reserve(triangleIndices.size() + changed.size());
+	copyNode(0, 0, moved, added, refit, built);
+
+	std::vector<float> costs(refit.nodes.size());
+	nodeCost(refit.nodes.data(), 0, boundsMin, boundsMax, costs.data());
+	UpdateResult result = UpdateResult::Refit;
+	if (costs[0] > settings.rebuildThreshold * built[0]) {
+		// follow the cost growth down to the smallest subtree that is responsible for most of it
+		std::vector<uint32_t> path;
+		uint32_t node = 0;
+		glm::vec3 voxelMin = boundsMin;
+		glm::vec3 voxelMax = boundsMax;
+		while (!refit.nodes[node].isLeaf()) {
+			const Node& current = refit.nodes[node];
+			uint32_t left = current.leftChild();
+			uint32_t right = current.rightChild();
+			uint32_t worst = costs[left] - built[left] >= costs[right] - built[right] ? left : right;
+			if (costs[worst] <= settings.rebuildThreshold * built[worst] || costs[worst] - built[worst] < (costs[node] - built[node]) * PARTIAL_REBUILD_SHARE)
+				break;
+			int axis = current.axis();
+			float pos = glm::clamp(current.split(), voxelMin[axis], voxelMax[axis]);
+			if (worst == left)
+				voxelMax[axis] = pos;
+			else
+				voxelMin[axis] = pos;
+			path.push_back(node);
+			node = worst;
+		}
+
+		if (path.empty()) {
+			rebuild();
+			return UpdateResult::FullRebuild;
+		}
+
+		// the subtree is built again from the triangles its leaves reference now
+		std::vector<uint32_t> subtreeTriangles;
+		std::vector<uint32_t> stack(1, node);
+		while (!stack.empty()) {
+			const Node& current = refit.nodes[stack.back()];
+			stack.pop_back();
+			if (current.isLeaf()) {
+				subtreeTriangles.insert(subtreeTriangles.end(), refit.indices.begin() + current.firstTriangle(), refit.indices.begin() + current.firstTriangle() + current.triangleCount());
+			}
+			else {
+				stack.push_back(current.rightChild());
+				stack.push_back(current.leftChild());
+			}
+		}
+		std::sort(subtreeTriangles.begin(), subtreeTriangles.end());
+		subtreeTriangles.erase(std::unique(subtreeTriangles.begin(), subtreeTriangles.end()), subtreeTriangles.end());
+		BoundsSoA refs;
+		refs.reserve(subtreeTriangles.size());
+		for (uint32_t triangle : subtreeTriangles) {
+			glm::vec3 refMin, refMax;
+			if (clippedBounds(triangle, voxelMin, voxelMax, refMin, refMax))
+				refs.add(triangle, refMin, refMax);
+		}
+
+		pool = &buildPool();
+		BuildOutput subtree;
+		subtree.nodes.resize(1);
+		int depth = std::max(depthLimit() - (int)path.size(), 0);
+		if (settings.lazy)
+			deferSubtree(refs, depth, subtree);
+		else
+			buildSubtree(refs, voxelMin, voxelMax, depth, subtree);
+		pool = nullptr;
+
+		size_t oldSize = refit.nodes.size();
+		float oldBuilt = built[node];
+		appendSubtree(refit, node, subtree);
+		costs.resize(refit.nodes.size());
+		nodeCost(refit.nodes.data(), 0, boundsMin, boundsMax, costs.data());
+		// the new subtree is the reference for later updates, its ancestors take over the change of its cost
+		built.resize(refit.nodes.size());
+		built[node] = costs[node];
+		for (size_t i = oldSize; i < refit.nodes.size(); i++) {
+			built[i] = costs[i];
+		}
+		for (uint32_t ancestor : path) {
+			built[ancestor] += costs[node] - oldBuilt;
+		}
+		// the old nodes of the subtree stay behind unreferenced, they are left out before the tree is stored
+		BuildOutput compact;
+		std::vector<float> compactBuilt;
+		compactTree(refit, built, compact, compactBuilt);
+		refit = std::move(compact);
+		built = std::move(compactBuilt);
+		result = UpdateResult::PartialRebuild;
+	}
+
+	std::swap(arena, spareArena);
+	arena.reset();
+	store(refit);
+	builtCosts = arena.copyArray(built.data(), built.size());
+	degradation = built[0] > 0.0f ? costs[0] / built[0] : 1.0f;
+	return result;
+}
+
+// sorts a moved triangle into the leaves below the node, the same way the builders distribute references
+void KDTree::insertReference(uint32_t node, uint32_t triangle, const glm::vec3& refMin, const glm::vec3& refMax, const glm::vec3& voxelMin, const glm::vec3& voxelMax, std::unordered_map<uint32_t, std::vector<uint32_t>>& added) const {
+	const Node& current = nodes[node];
+	if (current.isLeaf()) {
+		added[node].push_back(triangle);
 		return;
 	}
 
-	// find this node's split plane
-	// and call the method recursively on both children
-	if (pNode->splitPlane == 'x') {
-		fillBoxes(pNode->leftChild, xMin, pNode->splitPos, yMin, yMax, zMin, zMax);
-		fillBoxes(pNode->rightChild, pNode->splitPos, xMax, yMin, yMax, zMin, zMax);
+	int axis = current.axis();
+	float pos = current.split();
+	glm::vec3 leftMax = voxelMax;
+	glm::vec3 rightMin = voxelMin;
+	leftMax[axis] = pos;
+	rightMin[axis] = pos;
+	if (refMax[axis] <= pos) {
+		insertReference(current.leftChild(), triangle, refMin, refMax, voxelMin, leftMax, added);
 	}
-	else if (pNode->splitPlane == 'y') {
-		fillBoxes(pNode->leftChild, xMin, xMax, pNode->splitPos, yMax, zMin, zMax);
-		fillBoxes(pNode->rightChild, xMin, xMax, yMin, pNode->splitPos, zMin, zMax);
+	else if (refMin[axis] >= pos) {
+		insertReference(current.rightChild(), triangle, refMin, refMax, rightMin, voxelMax, added);
 	}
 	else {
-		fillBoxes(pNode->leftChild, xMin, xMax, yMin, yMax, pNode->splitPos, zMax);
-		fillBoxes(pNode->rightChild, xMin, xMax, yMin, yMax, zMin, pNode->splitPos);
+		glm::vec3 clipMin, clipMax;
+		if (clippedBounds(triangle, voxelMin, leftMax, clipMin, clipMax))
+			insertReference(current.leftChild(), triangle, clipMin, clipMax, voxelMin, leftMax, added);
+		if (clippedBounds(triangle, rightMin, voxelMax, clipMin, clipMax))
+			insertReference(current.rightChild(), triangle, clipMin, clipMax, rightMin, voxelMax, added);
+	}
+}
+
+// copies the subtree below the node into the slot of the output, without the moved triangles and with the inserted ones
+void KDTree::copyNode(uint32_t node, uint32_t slot, const std::vector<char>& moved, const std::unordered_map<uint32_t, std::vector<uint32_t>>& added, BuildOutput& out, std::vector<float>& built) const {
+	const Node& current = nodes[node];
+	built[slot] = builtCosts[node];
+	if (current.isLeaf()) {
+		uint32_t first = (uint32_t)out.indices.size();
+		for (uint32_t i = current.firstTriangle(); i < current.firstTriangle() + current.triangleCount(); i++) {
+			if (!moved[triangleIndices[i]])
+				out.indices.push_back(triangleIndices[i]);
+		}
+		auto inserted = added.find(node);
+		if (inserted != added.end())
+			out.indices.insert(out.indices.end(), inserted->second.begin(), inserted->second.end());
+		if (current.isPending())
+			out.nodes[slot] = Node::pending(first, (uint32_t)out.indices.size() - first);
+		else
+			out.nodes[slot] = Node::leaf(first, (uint32_t)out.indices.size() - first);
+		return;
 	}
+
+	uint32_t leftChild = (uint32_t)out.nodes.size();
+	out.nodes.resize(out.nodes.size() + 2);
+	built.resize(out.nodes.size());
+	out.nodes[slot] = Node::interior(current.axis(), current.split(), leftChild);
+	copyNode(current.leftChild(), leftChild, moved, added, out, built);
+	copyNode(current.rightChild(), leftChild + 1, moved, added, out, built);
 }
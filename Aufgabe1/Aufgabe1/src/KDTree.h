@@ -1,26 +1,185 @@
 #pragma once
+#include "AccelerationStructure.h"
 #include "Node.h"
 #include "Triangle.h"
 #include "Box.h"
+#include "ThreadPool.h"
+#include "Arena.h"
 #include <vector>
+#include <deque>
+#include <functional>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <cstdint>
+#include <algorithm>
 #include <glm/gtc/quaternion.hpp>
 #include <glm/gtx/quaternion.hpp>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
-class KDTree {
-	
-	void SortTriangles(std::vector<Triangle>& triangles, int from, int to, Node* currentNode);
-	Triangle* visitNodes(Node* pNode, const float* point, const float* direction, float tmax);
-	void fillBoxes(Node* pNode, float xMin, float xMax, float yMin, float yMax, float zMin, float zMax);
+
+class KDTree : public AccelerationStructure {
+	friend class TreeCache;	// stores the arrays of the tree and lets them point into a mapped file
+	// a candidate split plane of the SAH sweep
+	// every triangle creates a start and an end event (or one planar event if it is flat) per axis
+	struct SplitEvent {
+		float pos;
+		int triangle;
+		char axis;	// 0, 1 or 2
+		char type;	// END, PLANAR or START, sorted in this order for equal positions
+	};
+	static constexpr char END = 0, PLANAR = 1, START = 2;
+	static constexpr char LEFT = 0, RIGHT = 1, BOTH = 2;
+	// bounds of the triangle references of a node, one array per coordinate so that four of them can be processed at once
+	struct BoundsSoA {
+		std::vector<float> min[3];
+		std::vector<float> max[3];
+		std::vector<uint32_t> triangle;
+		size_t size() const { return triangle.size(); };
+		void clear();
+		void reserve(size_t count);
+		void add(uint32_t index, const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+	};
+	// nodes and leaf lists of a (sub)tree
+	// subtrees built by other threads get their own output, which is appended to the parent's afterwards
+	struct BuildOutput {
+		std::vector<Node> nodes;
+		std::vector<uint32_t> indices;
+	};
+	// rays of a packet, one SIMD lane per ray
+	struct PacketRays {
+		alignas(32) float origin[3][MAX_PACKET];
+		alignas(32) float inverse[3][MAX_PACKET];
+	};
+	// lists of the median split that is currently built, reused by every node the thread splits
+	struct MedianBuffers {
+		std::vector<float> centers;		// center of every reference on the split axis
+		std::vector<uint32_t> order;	// positions of the references, partitioned around the median
+		std::vector<uint32_t> scratch;	// room of the parallel partitioning
+		// reference lists of the children of the nodes on the thread's recursion path, two per node
+		// a deque, so the lists don't move while it grows
+		std::deque<BoundsSoA> references;
+		size_t referencesUsed = 0;
+	};
+	// node the packet traversal still has to visit and the interval of every ray inside it, empty for the rays that skip it
+	struct PacketEntry {
+		uint32_t node;
+		alignas(32) float tnear[MAX_PACKET];
+		alignas(32) float tfar[MAX_PACKET];
+	};
+	// a node of a lazy tree that still waits for its split
+	struct PendingNode {
+		glm::vec3 voxelMin, voxelMax;
+		int depth;	// levels the builders may still create below it
+	};
+	// state shared by the queries of a lazy tree
+	// queries hold the node lock shared while they read the arrays, an expansion builds the split of a node outside of it
+	// and only takes it exclusively to publish the new nodes, which may move the arrays to bigger memory
+	struct LazyState {
+		std::shared_timed_mutex nodeLock;
+		std::mutex expansionLock;	// one expansion at a time, only its owner changes the arrays
+		std::unordered_map<uint32_t, PendingNode> pending;	// filled from the tree when the first expansion after a store needs it
+		size_t nodeCapacity = 0;	// room of the node indexed arrays and of the index list
+		size_t indexCapacity = 0;
+	};
+	// the builders only write to their output and these scratch members, so they are const
+	// and a query of a lazy tree can split a node with them
+	mutable std::vector<std::vector<char>> triangleSides;	// LEFT, RIGHT or BOTH for the split that is currently built, one list per build thread
+	mutable std::vector<MedianBuffers> medianBuffers;	// one per build thread
+	mutable ThreadPool* pool = nullptr;	// only set while building
+	mutable std::unique_ptr<ThreadPool> threads;	// the pool of the builds, made for the thread count of the settings
+	mutable unsigned int threadCount = 0;
+
+	Arena spareArena;	// updates rewrite the tree into this arena and swap both afterwards
+	float sceneMin = 0.0f, sceneMax = 0.0f;	// extent of the scene given to build, the cache file keeps it
+	std::unique_ptr<LazyState> lazy;	// only exists while the settings ask for a lazy tree
+
+	void rebuild();
+	ThreadPool& buildPool() const;
+	void buildSubtree(BoundsSoA& refs, const glm::vec3& voxelMin, const glm::vec3& voxelMax, int depth, BuildOutput& out) const;
+	void deferSubtree(const BoundsSoA& refs, int depth, BuildOutput& out) const;
+	void resetLazy();
+	void collectPending(uint32_t node, const glm::vec3& voxelMin, const glm::vec3& voxelMax, int depth) const;
+	void expandNode(uint32_t node) const;
+	void splitPending(uint32_t node) const;
+	void SortTriangles(BoundsSoA& refs, const glm::vec3& voxelMin, const glm::vec3& voxelMax, uint32_t node, int depth, BuildOutput& out) const;
+	void BuildSAH(BoundsSoA& refs, const glm::vec3& voxelMin, const glm::vec3& voxelMax, int depth, BuildOutput& out) const;
+	void SplitSAH(std::vector<SplitEvent>& events, int count, const glm::vec3& voxelMin, const glm::vec3& voxelMax, uint32_t node, int depth, BuildOutput& out) const;
+	void makeLeafSAH(const std::vector<SplitEvent>& events, uint32_t node, BuildOutput& out) const;
+	void SplitBinned(BoundsSoA& refs, const glm::vec3& voxelMin, const glm::vec3& voxelMax, uint32_t node, int depth, BuildOutput& out) const;
+	void splitReferences(const BoundsSoA& refs, int axis, float pos, const glm::vec3& voxelMin, const glm::vec3& voxelMax, BoundsSoA& leftRefs, BoundsSoA& rightRefs) const;
+	bool clippedBounds(uint32_t triangle, const glm::vec3& voxelMin, const glm::vec3& voxelMax, glm::vec3& clipMin, glm::vec3& clipMax) const;
+	void splitChildren(BuildOutput& out, uint32_t leftChild, bool parallel, const std::function<void(uint32_t, BuildOutput&)>& buildLeft, const std::function<void(uint32_t, BuildOutput&)>& buildRight) const;
+	static void appendSubtree(BuildOutput& out, uint32_t node, const BuildOutput& subtree);
+	static void compactTree(const BuildOutput& tree, const std::vector<float>& built, BuildOutput& out, std::vector<float>& outBuilt);
+	float costSAH(const glm::vec3& voxelMin, const glm::vec3& voxelMax, int axis, float pos, int countLeft, int countRight) const;
+	static bool eventLess(const SplitEvent& first, const SplitEvent& second);
+	static void addEvents(std::vector<SplitEvent>& events, int triangle, const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+	Triangle* visitNodes(const float* point, const float* direction, float tmax, TriangleHit& hit, TraversalContext& context) const;
+	void visitPacket(int count, const glm::vec3* origins, const glm::vec3* directions, float tmax, Triangle** results, TriangleHit* hits, TraversalContext& context) const;
+	bool visitOccluders(const float* point, const float* direction, float tmax, TraversalContext& context) const;
+	bool reachesNode(uint32_t node, const glm::vec3& point, float limit, float& distance) const;
+	template <typename Visit>
+	void visitNeighbours(const glm::vec3& point, float& limit, TraversalContext& context, Visit visit) const;
+	template <typename Overlaps>
+	void visitVolume(const Frustum& frustum, std::vector<uint32_t>& result, TraversalContext& context, Overlaps overlaps) const;
+	void searchNeighbours(size_t count, NeighbourBuffer& result, const BatchSettings& batchSettings, const std::function<void(size_t, std::vector<Neighbour>&, TraversalContext&)>& search) const;
+	void fitBounds(uint32_t node, const glm::vec3& voxelMin, const glm::vec3& voxelMax) const;
+	glm::vec3 fittedMin(uint32_t node) const { return glm::vec3(nodeMin[0][node], nodeMin[1][node], nodeMin[2][node]); };
+	glm::vec3 fittedMax(uint32_t node) const { return glm::vec3(nodeMax[0][node], nodeMax[1][node], nodeMax[2][node]); };
+	float nodeCost(const Node* tree, uint32_t node, const glm::vec3& voxelMin, const glm::vec3& voxelMax, float* costs) const;
+	int depthLimit() const;
+	void store(const BuildOutput& out);
+	void storeRecords();
+	void storeBounds();
+	void storeBoxes() override;
+	void insertReference(uint32_t node, uint32_t triangle, const glm::vec3& refMin, const glm::vec3& refMax, const glm::vec3& voxelMin, const glm::vec3& voxelMax, std::unordered_map<uint32_t, std::vector<uint32_t>>& added) const;
+	void copyNode(uint32_t node, uint32_t slot, const std::vector<char>& moved, const std::unordered_map<uint32_t, std::vector<uint32_t>>& added, BuildOutput& out, std::vector<float>& built) const;
 public:
-	Node* root = nullptr;
-	glm::vec3 lastPoint = glm::vec3(0.0f);
-	std::vector<Box> boxes;
-	KDTree() : root() {};
-	KDTree(std::vector<Triangle>& triangles, float minVal, float maxVal);
-	KDTree(const KDTree& tree) : root(tree.root) {};
-	Triangle* searchHit(const float* point, const float* direction, float tmax);
-	bool testIntersection(const Triangle& triangle, glm::vec3 origin, glm::vec3 direction, glm::vec3& intersection);
-	float orient(const glm::vec3& a, const  glm::vec3& b, const  glm::vec3& c, const  glm::vec3& d);
+	// the arrays live in the arena or, for a tree loaded by TreeCache, in the mapped cache file
+	// they are mutable because the const queries of a lazy tree grow them when they split a pending node,
+	// which happens under the node lock of the lazy state, the queries of other trees never write to them
+	mutable Arena arena;				// owns the nodes, the leaf lists and the boxes of the current build
+	mutable ArenaArray<Node> nodes;		// the flattened tree, the root is the first node
+	mutable ArenaArray<uint32_t> triangleIndices;	// triangle lists of the leaves
+	mutable TriangleRecords records;	// corners of the triangles in the order of triangleIndices, the only triangle data a query reads
+	// bounds of the triangles below every node, clipped to the node's voxel, one array per coordinate
+	// queries clip rays with the bounds of the root, the boxes for drawing are made from them, nodes without triangles have empty bounds
+	mutable ArenaArray<float> nodeMin[3], nodeMax[3];
+	mutable ArenaArray<float> builtCosts;	// SAH cost of every subtree when it was built, updates compare against it
+	KDTree() {};
+	KDTree(std::vector<Triangle>& triangles, float minVal, float maxVal, const BuildSettings& settings = BuildSettings());
+	KDTree(const KDTree& other);
+	KDTree& operator=(const KDTree& other);
+	KDTree(KDTree&& other) = default;
+	KDTree& operator=(KDTree&& other) = default;
+	using AccelerationStructure::build;
+	using AccelerationStructure::update;
+	void build(Triangle* triangles, uint32_t count, float minVal, float maxVal, const BuildSettings& settings) override;
+	// the triangles with the given indices have moved, they are sorted into the leaves again
+	// and the part of the tree whose cost grew too much is rebuilt
+	UpdateResult update(const std::vector<uint32_t>& changed) override;
+	Triangle* findHit(const float* point, const float* direction, float tmax, TriangleHit& hit, TraversalContext& context) const override;
+	bool occluded(const float* point, const float* direction, float tmax, TraversalContext& context) const override;
+	// walks the tree with up to MAX_PACKET rays at once
+	void searchPacket(int count, const glm::vec3* origins, const glm::vec3* directions, float tmax, Triangle** results, TriangleHit* hits, TraversalContext& context) const override;
+	// the k triangles with the centroids closest to the point, at most maxDistance away, ordered by distance
+	// triangles at the same distance are ordered by their index, so the result equals the one of a search over all triangles
+	// like query any number of threads may search at once, each with its own context
+	void nearestTriangles(const glm::vec3& point, int k, float maxDistance, std::vector<Neighbour>& result, TraversalContext& context) const;
+	// every triangle with its centroid at most radius away from the point, ordered by distance
+	void trianglesInRadius(const glm::vec3& point, float radius, std::vector<Neighbour>& result, TraversalContext& context) const;
+	// every triangle that overlaps the box, ordered by index
+	// subtrees that lie inside the box are taken without testing their triangles
+	void trianglesInBox(const glm::vec3& boxMin, const glm::vec3& boxMax, std::vector<uint32_t>& result, TraversalContext& context) const;
+	// every triangle that doesn't lie outside of one of the planes with all three corners, ordered by index
+	// a triangle close to an edge of the frustum may be reported without reaching into it, which is enough for culling
+	void trianglesInFrustum(const Frustum& frustum, std::vector<uint32_t>& result, TraversalContext& context) const;
+	// nearestTriangles and trianglesInRadius for count points, answered by a pool of threads
+	void nearestBatch(size_t count, const glm::vec3* points, int k, float maxDistance, NeighbourBuffer& result, const BatchSettings& batchSettings = BatchSettings()) const;
+	void radiusBatch(size_t count, const glm::vec3* points, float radius, NeighbourBuffer& result, const BatchSettings& batchSettings = BatchSettings()) const;
+	AccelerationStats stats() const override;
+	float expectedCost() const;
 };
\ No newline at end of file
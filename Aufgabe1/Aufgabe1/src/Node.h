@@ -1,19 +1,58 @@
 #pragma once
-#include "Triangle.h"
+#include <cstdint>
+
+// node of the flattened tree, all nodes of a tree are stored in one array
+// interior nodes keep the split axis (0, 1 or 2) in the two lowest bits and the index of their left child above it,
+// the right child is always stored directly after the left one
+// leaves have 3 in the two lowest bits and the number of their triangles above it,
+// the triangles are a range of the tree's triangle index list
+// a pending leaf additionally has the highest bit set, it belongs to a lazy tree and is split when a query first reaches it
 class Node {
+	uint32_t flags;
+	union {
+		float splitPos;
+		uint32_t leafFirst;
+	};
 public:
-	Node* leftChild;
-	Node* rightChild;
-	char splitPlane;	// either 'x', 'y' , 'z' or 'o' for not assigned yet
-	float splitPos;
-	Triangle* contents;
-	Node() : leftChild(nullptr), rightChild(nullptr), splitPlane('o'), splitPos(0), contents(nullptr) {};
-	Node(Node* leftChild,Node* rightChild,char splitPlane,float splitPos,Triangle* contents) : leftChild(nullptr), rightChild(nullptr), splitPlane('o'), splitPos(0), contents(nullptr) {};
-	Node(const Node& node) {
-		this->contents = node.contents;
-		this->leftChild = node.leftChild;
-		this->rightChild = node.rightChild;
-		this->splitPlane = node.splitPlane;
-		this->splitPos = node.splitPos;
+	static constexpr uint32_t LEAF = 3;
+	static constexpr uint32_t PENDING = 1u << 31;
+
+	Node() : flags(LEAF), leafFirst(0) {};
+	static Node interior(int axis, float splitPos, uint32_t leftChild) {
+		Node node;
+		node.flags = (leftChild << 2) | (uint32_t)axis;
+		node.splitPos = splitPos;
+		return node;
 	}
-};
\ No newline at end of file
+	static Node leaf(uint32_t first, uint32_t count) {
+		Node node;
+		node.flags = (count << 2) | LEAF;
+		node.leafFirst = first;
+		return node;
+	}
+	static Node pending(uint32_t first, uint32_t count) {
+		Node node = leaf(first, count);
+		node.flags |= PENDING;
+		return node;
+	}
+
+	bool isLeaf() const { return (flags & 3) == LEAF; };
+	bool isPending() const { return (flags & (PENDING | 3)) == (PENDING | LEAF); };
+	int axis() const { return (int)(flags & 3); };
+	float split() const { return splitPos; };
+	uint32_t leftChild() const { return flags >> 2; };
+	uint32_t rightChild() const { return (flags >> 2) + 1; };
+	uint32_t firstTriangle() const { return leafFirst; };
+	uint32_t triangleCount() const { return (flags & ~PENDING) >> 2; };
+
+	// the same node after its subtree was moved by nodeOffset in the node array and by indexOffset in the index list
+	Node relocated(uint32_t nodeOffset, uint32_t indexOffset) const {
+		if (isPending())
+			return pending(leafFirst + indexOffset, triangleCount());
+		if (isLeaf())
+			return leaf(leafFirst + indexOffset, triangleCount());
+		return interior(axis(), splitPos, leftChild() + nodeOffset);
+	}
+};
+
+static_assert(sizeof(Node) == 8, "nodes have to stay 8 bytes to keep the tree cache friendly");
@@ -0,0 +1,13 @@
+#pragma once
+
+// SIMD instruction sets available on the target
+// SSE2 is part of every x64 target, AVX has to be enabled with /arch:AVX (or -mavx)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KDTREE_SSE 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX__)
+#define KDTREE_AVX 1
+#include <immintrin.h>
+#endif
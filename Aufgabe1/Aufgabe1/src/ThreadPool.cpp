@@ -0,0 +1,118 @@
+#include "ThreadPool.h"
+#include <algorithm>
+#include <iterator>
+
+namespace {
+	// pool and index of the worker that runs on this thread
+	thread_local const ThreadPool* currentPool = nullptr;
+	thread_local unsigned int currentIndex = 0;
+}
+
+ThreadPool::ThreadPool(unsigned int threadCount) {
+	if (threadCount == 0)
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+	for (unsigned int i = 1; i < threadCount; i++) {
+		workers.emplace_back(&ThreadPool::workerLoop, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wakeUp.notify_all();
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+}
+
+unsigned int ThreadPool::index() const {
+	return currentPool == this ? currentIndex : 0;
+}
+
+void ThreadPool::run(TaskGroup& group, std::function<void()> task) {
+	// without workers there is nobody to hand the task to
+	if (workers.empty()) {
+		task();
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		group.pending++;
+		tasks.push_back({ std::move(task), &group });
+	}
+	wakeUp.notify_all();
+}
+
+void ThreadPool::wait(TaskGroup& group) {
+	waitFor(group, false);
+}
+
+void ThreadPool::parallelFor(size_t count, size_t grainSize, const std::function<void(size_t, size_t)>& body) {
+	grainSize = std::max<size_t>(grainSize, 1);
+	if (workers.empty() || count <= grainSize) {
+		if (count > 0)
+			body(0, count);
+		return;
+	}
+
+	// a few chunks per thread balance the load without creating too many tasks
+	size_t chunkCount = std::min<size_t>((count + grainSize - 1) / grainSize, (size_t)size() * 4);
+	size_t chunkSize = (count + chunkCount - 1) / chunkCount;
+	TaskGroup group;
+	for (size_t begin = chunkSize; begin < count; begin += chunkSize) {
+		size_t end = std::min(begin + chunkSize, count);
+		run(group, [&body, begin, end]() { body(begin, end); });
+	}
+	body(0, std::min(chunkSize, count));
+	// only the chunks are executed while waiting here, the caller may still hold per thread state
+	waitFor(group, true);
+}
+
+void ThreadPool::workerLoop(unsigned int workerIndex) {
+	currentPool = this;
+	currentIndex = workerIndex;
+
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		wakeUp.wait(lock, [this]() { return stopping || !tasks.empty(); });
+		if (tasks.empty())
+			return;
+		Task task = std::move(tasks.back());
+		tasks.pop_back();
+		execute(task, lock);
+	}
+}
+
+void ThreadPool::waitFor(TaskGroup& group, bool ownTasksOnly) {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (group.pending > 0) {
+		// the newest task is taken first, which keeps the recursion of nested tasks shallow
+		auto it = tasks.end();
+		for (auto candidate = tasks.rbegin(); candidate != tasks.rend(); ++candidate) {
+			if (!ownTasksOnly || candidate->group == &group) {
+				it = std::prev(candidate.base());
+				break;
+			}
+		}
+
+		if (it == tasks.end()) {
+			wakeUp.wait(lock);
+			continue;
+		}
+		Task task = std::move(*it);
+		tasks.erase(it);
+		execute(task, lock);
+	}
+}
+
+// runs the task without holding the lock and reports it as finished to its group
+void ThreadPool::execute(Task& task, std::unique_lock<std::mutex>& lock) {
+	lock.unlock();
+	task.function();
+	lock.lock();
+	task.group->pending--;
+	wakeUp.notify_all();
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <algorithm>
+
+/**
+ * Fixed size pool of worker threads.
+ * A thread that waits for a group of tasks helps executing queued tasks in the meantime,
+ * so tasks may start and wait for subtasks themselves without blocking the pool.
+ */
+class ThreadPool {
+public:
+	// counts the unfinished tasks that were started for it
+	class TaskGroup {
+		friend class ThreadPool;
+		int pending = 0;
+	};
+
+	// the thread count includes the thread that owns the pool, 0 uses every hardware thread
+	explicit ThreadPool(unsigned int threadCount);
+	~ThreadPool();
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	unsigned int size() const { return (unsigned int)workers.size() + 1; };
+	// index of the calling thread in [0, size()), the owning thread and foreign threads get 0
+	unsigned int index() const;
+
+	void run(TaskGroup& group, std::function<void()> task);
+	void wait(TaskGroup& group);
+	// calls body(begin, end) for consecutive chunks of at least grainSize elements of [0, count)
+	void parallelFor(size_t count, size_t grainSize, const std::function<void(size_t, size_t)>& body);
+	// sorts like std::sort, with more threads the chunks are sorted in parallel and merged pairwise afterwards
+	// fewer than PARALLEL_SORT_SIZE values are sorted by the calling thread alone
+	template <typename T, typename Less>
+	void parallelSort(std::vector<T>& values, Less less);
+
+	static const size_t PARALLEL_SORT_SIZE = 65536;
+
+private:
+	struct Task {
+		std::function<void()> function;
+		TaskGroup* group;
+	};
+	std::vector<std::thread> workers;
+	std::deque<Task> tasks;
+	std::mutex mutex;
+	std::condition_variable wakeUp;
+	bool stopping = false;
+
+	void workerLoop(unsigned int workerIndex);
+	void waitFor(TaskGroup& group, bool ownTasksOnly);
+	void execute(Task& task, std::unique_lock<std::mutex>& lock);
+};
+
+template <typename T, typename Less>
+void ThreadPool::parallelSort(std::vector<T>& values, Less less) {
+	if (size() == 1 || values.size() < PARALLEL_SORT_SIZE) {
+		std::sort(values.begin(), values.end(), less);
+		return;
+	}
+
+	size_t count = values.size();
+	size_t chunkSize = (count + size() - 1) / size();
+	parallelFor(size(), 1, [&](size_t begin, size_t end) {
+		for (size_t chunk = begin; chunk < end; chunk++) {
+			std::sort(values.begin() + std::min(chunk * chunkSize, count), values.begin() + std::min((chunk + 1) * chunkSize, count), less);
+		}
+	});
+	for (size_t width = chunkSize; width < count; width *= 2) {
+		size_t pairs = (count + 2 * width - 1) / (2 * width);
+		parallelFor(pairs, 1, [&](size_t begin, size_t end) {
+			for (size_t pair = begin; pair < end; pair++) {
+				size_t first = pair * 2 * width;
+				size_t middle = std::min(first + width, count);
+				size_t last = std::min(first + 2 * width, count);
+				std::inplace_merge(values.begin() + first, values.begin() + middle, values.begin() + last, less);
+			}
+		});
+	}
+}
@@ -0,0 +1,262 @@
+#include "TreeCache.h"
+#include <fstream>
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+	const char MAGIC[8] = { 'K', 'D', 'T', 'R', 'E', 'E', 0, 0 };
+
+	uint64_t alignUp(uint64_t offset, uint64_t alignment) {
+		return (offset + alignment - 1) / alignment * alignment;
+	}
+
+	// writes the array at its offset, the gap before it is filled with zeros
+	void writeArray(std::ofstream& file, uint64_t& position, uint64_t offset, const void* data, size_t size) {
+		static const char zeros[64] = {};
+		while (position < offset) {
+			uint64_t gap = std::min<uint64_t>(offset - position, sizeof(zeros));
+			file.write(zeros, (std::streamsize)gap);
+			position += gap;
+		}
+		file.write(static_cast<const char*>(data), (std::streamsize)size);
+		position += size;
+	}
+}
+
+TreeCache::~TreeCache() {
+	close();
+}
+
+uint64_t TreeCache::hash(uint64_t hash, const void* data, size_t size) {
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+bool TreeCache::write(const std::string& path, uint64_t sceneKey, const KDTree& tree) {
+	Header header;
+	std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = VERSION;
+	header.byteOrder = BYTE_ORDER_MARK;
+	header.sceneKey = sceneKey;
+	header.triangleSize = sizeof(Triangle);
+	header.nodeSize = sizeof(Node);
+	header.triangleCount = tree.triangleCount;
+	header.nodeCount = tree.nodes.size();
+	header.indexCount = tree.triangleIndices.size();
+	header.trianglesOffset = alignUp(sizeof(Header), ALIGNMENT);
+	header.nodesOffset = alignUp(header.trianglesOffset + header.triangleCount * sizeof(Triangle), ALIGNMENT);
+	header.indicesOffset = alignUp(header.nodesOffset + header.nodeCount * sizeof(Node), ALIGNMENT);
+	header.costsOffset = alignUp(header.indicesOffset + header.indexCount * sizeof(uint32_t), ALIGNMENT);
+	// every coordinate array of the records keeps the padding that SIMD loads of the last leaf may read
+	size_t recordCount = header.indexCount + TriangleRecords::PADDING;
+	header.recordsOffset = alignUp(header.costsOffset + header.nodeCount * sizeof(float), ALIGNMENT);
+	header.recordStride = alignUp(recordCount * sizeof(float), ALIGNMENT);
+	header.nodeBoundsOffset = header.recordsOffset + 9 * header.recordStride;
+	header.nodeBoundsStride = alignUp(header.nodeCount * sizeof(float), ALIGNMENT);
+	header.fileSize = header.nodeBoundsOffset + 6 * header.nodeBoundsStride;
+	for (int axis = 0; axis < 3; axis++) {
+		header.boundsMin[axis] = tree.boundsMin[axis];
+		header.boundsMax[axis] = tree.boundsMax[axis];
+	}
+	header.sceneMin = tree.sceneMin;
+	header.sceneMax = tree.sceneMax;
+
+	// the file only gets its name once it is complete, so a crash never leaves a broken cache behind
+	std::string temporaryPath = path + ".tmp";
+	{
+		std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+		if (!file)
+			return false;
+		uint64_t position = 0;
+		writeArray(file, position, 0, &header, sizeof(Header));
+		writeArray(file, position, header.trianglesOffset, tree.triangleData, header.triangleCount * sizeof(Triangle));
+		writeArray(file, position, header.nodesOffset, tree.nodes.data(), header.nodeCount * sizeof(Node));
+		writeArray(file, position, header.indicesOffset, tree.triangleIndices.data(), header.indexCount * sizeof(uint32_t));
+		writeArray(file, position, header.costsOffset, tree.builtCosts.data(), tree.builtCosts.size() * sizeof(float));
+		for (int corner = 0; corner < 3; corner++) {
+			for (int axis = 0; axis < 3; axis++) {
+				uint64_t offset = header.recordsOffset + (corner * 3 + axis) * header.recordStride;
+				writeArray(file, position, offset, tree.records.corners[corner][axis].data(), recordCount * sizeof(float));
+			}
+		}
+		for (int axis = 0; axis < 3; axis++) {
+			writeArray(file, position, header.nodeBoundsOffset + axis * header.nodeBoundsStride, tree.nodeMin[axis].data(), header.nodeCount * sizeof(float));
+		}
+		for (int axis = 0; axis < 3; axis++) {
+			writeArray(file, position, header.nodeBoundsOffset + (3 + axis) * header.nodeBoundsStride, tree.nodeMax[axis].data(), header.nodeCount * sizeof(float));
+		}
+		// the last array ends on the stride as well, so the size of the file is the one in the header
+		writeArray(file, position, header.fileSize, nullptr, 0);
+		if (!file)
+			return false;
+	}
+	std::remove(path.c_str());
+	return std::rename(temporaryPath.c_str(), path.c_str()) == 0;
+}
+
+bool TreeCache::load(const std::string& path, uint64_t sceneKey, const BuildSettings& settings, KDTree& tree) {
+	close();
+	if (!map(path))
+		return false;
+
+	Header header;
+	if (mappingSize < sizeof(Header)) {
+		close();
+		return false;
+	}
+	std::memcpy(&header, mapping, sizeof(Header));
+	const char* problem = nullptr;
+	if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0)
+		problem = "is no tree cache";
+	else if (header.byteOrder != BYTE_ORDER_MARK)
+		problem = "was written with another byte order";
+	else if (header.version != VERSION)
+		problem = "has another format version";
+	else if (header.triangleSize != sizeof(Triangle) || header.nodeSize != sizeof(Node))
+		problem = "was written by another build of the program";
+	else if (header.sceneKey != sceneKey)
+		problem = "belongs to another scene";
+	else if (header.fileSize != mappingSize || header.nodeCount == 0
+		|| header.trianglesOffset + header.triangleCount * sizeof(Triangle) > header.nodesOffset
+		|| header.nodesOffset + header.nodeCount * sizeof(Node) > header.indicesOffset
+		|| header.indicesOffset + header.indexCount * sizeof(uint32_t) > header.costsOffset
+		|| header.costsOffset + header.nodeCount * sizeof(float) > header.recordsOffset
+		|| header.recordStride < (header.indexCount + TriangleRecords::PADDING) * sizeof(float)
+		|| header.recordsOffset + 9 * header.recordStride > header.nodeBoundsOffset
+		|| header.nodeBoundsStride < header.nodeCount * sizeof(float)
+		|| header.nodeBoundsOffset + 6 * header.nodeBoundsStride > header.fileSize)
+		problem = "is incomplete";
+	if (problem != nullptr) {
+		std::cerr << "Cache file " << path << " " << problem << ", the tree is built again" << std::endl;
+		close();
+		return false;
+	}
+
+	triangles.items = reinterpret_cast<Triangle*>(mapping + header.trianglesOffset);
+	triangles.count = (size_t)header.triangleCount;
+
+	// the tree only gets views into the mapping, its own arena just holds the boxes for drawing
+	tree.settings = settings;
+	if (tree.arena.usesHugePages() != settings.hugePages) {
+		tree.arena = Arena(settings.hugePages);
+		tree.spareArena = Arena(settings.hugePages);
+	}
+	tree.arena.reset();
+	tree.triangleData = triangles.items;
+	tree.triangleCount = (uint32_t)header.triangleCount;
+	tree.nodes.items = reinterpret_cast<Node*>(mapping + header.nodesOffset);
+	tree.nodes.count = (size_t)header.nodeCount;
+	tree.triangleIndices.items = reinterpret_cast<uint32_t*>(mapping + header.indicesOffset);
+	tree.triangleIndices.count = (size_t)header.indexCount;
+	tree.builtCosts.items = reinterpret_cast<float*>(mapping + header.costsOffset);
+	tree.builtCosts.count = (size_t)header.nodeCount;
+	tree.boundsMin = glm::vec3(header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]);
+	tree.boundsMax = glm::vec3(header.boundsMax[0], header.boundsMax[1], header.boundsMax[2]);
+	tree.sceneMin = header.sceneMin;
+	tree.sceneMax = header.sceneMax;
+	tree.degradation = 1.0f;
+	tree.records = TriangleRecords();
+	for (int corner = 0; corner < 3; corner++) {
+		for (int axis = 0; axis < 3; axis++) {
+			ArenaArray<float>& values = tree.records.corners[corner][axis];
+			values.items = reinterpret_cast<float*>(mapping + header.recordsOffset + (corner * 3 + axis) * header.recordStride);
+			values.count = (size_t)(header.indexCount + TriangleRecords::PADDING);
+		}
+	}
+	for (int axis = 0; axis < 3; axis++) {
+		tree.nodeMin[axis].items = reinterpret_cast<float*>(mapping + header.nodeBoundsOffset + axis * header.nodeBoundsStride);
+		tree.nodeMin[axis].count = (size_t)header.nodeCount;
+		tree.nodeMax[axis].items = reinterpret_cast<float*>(mapping + header.nodeBoundsOffset + (3 + axis) * header.nodeBoundsStride);
+		tree.nodeMax[axis].count = (size_t)header.nodeCount;
+	}
+	tree.boxes = ArenaArray<Box>();
+	tree.boxesStored = false;
+	tree.resetLazy();
+	return true;
+}
+
+#ifdef _WIN32
+bool TreeCache::map(const std::string& path) {
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		CloseHandle(file);
+		return false;
+	}
+	HANDLE mappingObject = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+	if (mappingObject == nullptr) {
+		CloseHandle(file);
+		return false;
+	}
+	void* view = MapViewOfFile(mappingObject, FILE_MAP_COPY, 0, 0, 0);
+	if (view == nullptr) {
+		CloseHandle(mappingObject);
+		CloseHandle(file);
+		return false;
+	}
+	fileHandle = file;
+	mappingHandle = mappingObject;
+	mapping = static_cast<char*>(view);
+	mappingSize = (size_t)size.QuadPart;
+	return true;
+}
+
+void TreeCache::close() {
+	if (mapping != nullptr)
+		UnmapViewOfFile(mapping);
+	if (mappingHandle != nullptr)
+		CloseHandle(mappingHandle);
+	if (fileHandle != nullptr)
+		CloseHandle(fileHandle);
+	mapping = nullptr;
+	mappingSize = 0;
+	mappingHandle = nullptr;
+	fileHandle = nullptr;
+	triangles = ArenaArray<Triangle>();
+}
+#else
+bool TreeCache::map(const std::string& path) {
+	int file = open(path.c_str(), O_RDONLY);
+	if (file < 0)
+		return false;
+	struct stat status;
+	if (fstat(file, &status) != 0 || status.st_size == 0) {
+		::close(file);
+		return false;
+	}
+	// private pages are copied on the first write, the file itself is never changed
+	void* view = mmap(nullptr, (size_t)status.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+	::close(file);
+	if (view == MAP_FAILED)
+		return false;
+	mapping = static_cast<char*>(view);
+	mappingSize = (size_t)status.st_size;
+	return true;
+}
+
+void TreeCache::close() {
+	if (mapping != nullptr)
+		munmap(mapping, mappingSize);
+	mapping = nullptr;
+	mappingSize = 0;
+	triangles = ArenaArray<Triangle>();
+}
+#endif
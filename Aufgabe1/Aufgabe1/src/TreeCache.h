@@ -0,0 +1,81 @@
+#pragma once
+#include "KDTree.h"
+#include "Triangle.h"
+#include "Arena.h"
+#include <string>
+#include <cstdint>
+
+/**
+ * Binary file holding a built tree together with the triangles it was built from.
+ * The file starts with a header naming the format version, the byte order and the scene it belongs to,
+ * followed by the triangles, the nodes, the leaf lists, the node costs, the corner records of the leaf lists
+ * and the fitted node bounds, each array starting on a 64 byte boundary.
+ * Loading maps the file into memory and lets the tree work directly on the mapped arrays, nothing is parsed or copied.
+ * The mapping is copy on write, so moving triangles or updating the tree only changes the memory of this process.
+ */
+class TreeCache {
+public:
+	// 2: trees are at most 64 levels deep, the size of the traversal stack
+	// 3: the corner records of the leaf lists and the fitted node bounds are stored as well
+	// 4: the triangles store the corners of their bounds instead of half sizes around the center
+	static const uint32_t VERSION = 4;
+	// start value of the scene hash (FNV-1a)
+	static const uint64_t HASH_START = 14695981039346656037ull;
+
+	// the triangles of the loaded scene
+	ArenaArray<Triangle> triangles;
+
+	TreeCache() {};
+	~TreeCache();
+	TreeCache(const TreeCache&) = delete;
+	TreeCache& operator=(const TreeCache&) = delete;
+
+	// adds the bytes of a value to the hash identifying a scene
+	static uint64_t hash(uint64_t hash, const void* data, size_t size);
+	template <typename T>
+	static uint64_t hash(uint64_t hash, const T& value) { return TreeCache::hash(hash, &value, sizeof(T)); };
+
+	// writes the tree and its triangles, returns false if the file could not be written
+	static bool write(const std::string& path, uint64_t sceneKey, const KDTree& tree);
+	// maps the file and lets the tree use it, the cache has to stay open as long as the tree is used
+	// returns false if the file is missing or was written for another scene, format version or byte order
+	bool load(const std::string& path, uint64_t sceneKey, const BuildSettings& settings, KDTree& tree);
+	void close();
+
+private:
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t byteOrder;		// BYTE_ORDER_MARK as written by the machine that created the file
+		uint64_t sceneKey;
+		uint32_t triangleSize;	// sizeof(Triangle) and sizeof(Node) of the writer, other compilers may lay them out differently
+		uint32_t nodeSize;
+		uint64_t triangleCount;
+		uint64_t nodeCount;
+		uint64_t indexCount;
+		uint64_t trianglesOffset;
+		uint64_t nodesOffset;
+		uint64_t indicesOffset;
+		uint64_t costsOffset;
+		uint64_t recordsOffset;	// the nine coordinate arrays of the records follow each other recordStride bytes apart
+		uint64_t recordStride;
+		uint64_t nodeBoundsOffset;	// nodeMin[0..2] and nodeMax[0..2] follow each other nodeBoundsStride bytes apart
+		uint64_t nodeBoundsStride;
+		uint64_t fileSize;
+		float boundsMin[3];
+		float boundsMax[3];
+		float sceneMin;
+		float sceneMax;
+	};
+	static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+	static const uint64_t ALIGNMENT = 64;
+
+	char* mapping = nullptr;
+	size_t mappingSize = 0;
+#ifdef _WIN32
+	void* fileHandle = nullptr;
+	void* mappingHandle = nullptr;
+#endif
+
+	bool map(const std::string& path);
+};
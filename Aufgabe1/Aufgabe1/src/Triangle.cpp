@@ -34,12 +34,11 @@ Triangle::Triangle(const glm::mat4& mat) {
 		if (corners[i].z < minZ)
 			minZ = corners[i].z;
 	}
-	bvSize[0] = (maxX - minX) / 2;
-	bvSize[1] = (maxY - minY) / 2;
-	bvSize[2] = (maxZ - minZ) / 2;
+	boundsMin = glm::vec3(minX, minY, minZ);
+	boundsMax = glm::vec3(maxX, maxY, maxZ);
 
 	// calculate the center of the bounding volume
-	center = glm::vec4(minX + bvSize[0], minY + bvSize[1], minZ + bvSize[2], 1);
+	center = glm::vec4((minX + maxX) / 2, (minY + maxY) / 2, (minZ + maxZ) / 2, 1);
 
 	//std::cout << corners[0].x << ", " << corners[1].x << ", " << corners[2].x << std::endl;
 	//std::cout << corners[0].y << ", " << corners[1].y << ", " << corners[2].y << std::endl;
@@ -47,7 +46,7 @@ Triangle::Triangle(const glm::mat4& mat) {
 	//std::cout << std::endl;
 
 	//std::cout << center.x << ", " << center.y << ", " << center.z << std::endl;
-	//std::cout << bvSize[0] << ", " << bvSize[1] << ", " << bvSize[2] << std::endl;
+	//std::cout << boundsMax.x - boundsMin.x << ", " << boundsMax.y - boundsMin.y << ", " << boundsMax.z - boundsMin.z << std::endl;
 }
 
 glm::mat4 Triangle::getModelMat(float zShift) {
@@ -10,7 +10,9 @@ private:
 	glm::vec4 corners[3];
 	glm::vec4 center;
 	glm::mat4 modelMatrix;
-	float bvSize[3];
+	// bounding volume, the extremes of the corners themselves so that it contains them exactly
+	glm::vec3 boundsMin;
+	glm::vec3 boundsMax;
 public:
 	static constexpr float mesh[33] = {
 		//positions				  //normals				  //uvs				//tangents
@@ -31,6 +33,9 @@ public:
 	float getCenterX() const { return center.x; };
 	float getCenterY() const { return center.y; };
 	float getCenterZ() const { return center.z; };
+	// corners of the axis aligned bounding volume
+	glm::vec3 getMin() const { return boundsMin; };
+	glm::vec3 getMax() const { return boundsMax; };
 	glm::vec3 getCorner(int i) const{
 		return glm::vec3(corners[i].x, corners[i].y, corners[i].z);
 	}
@@ -0,0 +1,360 @@
+#include "WideBVH.h"
+#include "Simd.h"
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+namespace {
+	// depth limit of the binary build, every wide level covers at least one binary level
+	const int MAX_DEPTH = 64;
+
+	float halfArea(const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+		glm::vec3 size = boundsMax - boundsMin;
+		return size.x * size.y + size.y * size.z + size.z * size.x;
+	}
+
+	float halfArea(const BVHNode& node) {
+		return halfArea(glm::vec3(node.boundsMin[0], node.boundsMin[1], node.boundsMin[2]), glm::vec3(node.boundsMax[0], node.boundsMax[1], node.boundsMax[2]));
+	}
+
+	// ray of a query, negative tells per axis whether the ray runs towards smaller values and meets the maximum bound first
+	struct SlabRay {
+		float origin[3];
+		float inverse[3];
+		bool negative[3];
+	};
+
+	// child that waits for its visit, count is 0 for interior nodes
+	struct StackEntry {
+		uint32_t child;
+		uint32_t count;
+		float entry;
+	};
+
+#ifdef KDTREE_SSE
+	// slab test of the four children starting at lane, bit i of the result is set if the ray enters child lane + i
+	inline int slabTest4(const float* const* nearBounds, const float* const* farBounds, const SlabRay& ray, float tmax, int lane, float* entries) {
+		__m128 entry = _mm_setzero_ps();
+		__m128 exit = _mm_set1_ps(tmax);
+		for (int axis = 0; axis < 3; axis++) {
+			__m128 origin = _mm_set1_ps(ray.origin[axis]);
+			__m128 inverse = _mm_set1_ps(ray.inverse[axis]);
+			entry = _mm_max_ps(entry, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearBounds[axis] + lane), origin), inverse));
+			exit = _mm_min_ps(exit, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(farBounds[axis] + lane), origin), inverse));
+		}
+		_mm_storeu_ps(entries + lane, entry);
+		return _mm_movemask_ps(_mm_cmple_ps(entry, exit)) << lane;
+	}
+#endif
+
+#ifdef KDTREE_AVX
+	inline int slabTest8(const float* const* nearBounds, const float* const* farBounds, const SlabRay& ray, float tmax, float* entries) {
+		__m256 entry = _mm256_setzero_ps();
+		__m256 exit = _mm256_set1_ps(tmax);
+		for (int axis = 0; axis < 3; axis++) {
+			__m256 origin = _mm256_set1_ps(ray.origin[axis]);
+			__m256 inverse = _mm256_set1_ps(ray.inverse[axis]);
+			entry = _mm256_max_ps(entry, _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(nearBounds[axis]), origin), inverse));
+			exit = _mm256_min_ps(exit, _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(farBounds[axis]), origin), inverse));
+		}
+		_mm256_storeu_ps(entries, entry);
+		return _mm256_movemask_ps(_mm256_cmp_ps(entry, exit, _CMP_LE_OQ));
+	}
+#endif
+
+	// tests the ray against all children of the node within [0, tmax], bit i of the result is set if it enters child i at entries[i]
+	// the bound the ray meets first on an axis is picked once per ray, so the empty bounds of unused slots are never entered
+	template <int WIDTH>
+	int intersectChildren(const WideNode<WIDTH>& node, const SlabRay& ray, float tmax, float* entries) {
+		const float* nearBounds[3];
+		const float* farBounds[3];
+		for (int axis = 0; axis < 3; axis++) {
+			nearBounds[axis] = ray.negative[axis] ? node.boundsMax[axis] : node.boundsMin[axis];
+			farBounds[axis] = ray.negative[axis] ? node.boundsMin[axis] : node.boundsMax[axis];
+		}
+#ifdef KDTREE_AVX
+		if (WIDTH == 8)
+			return slabTest8(nearBounds, farBounds, ray, tmax, entries);
+#endif
+#ifdef KDTREE_SSE
+		int mask = 0;
+		for (int lane = 0; lane < WIDTH; lane += 4) {
+			mask |= slabTest4(nearBounds, farBounds, ray, tmax, lane, entries);
+		}
+		return mask;
+#else
+		int mask = 0;
+		for (int lane = 0; lane < WIDTH; lane++) {
+			float entry = 0.0f;
+			float exit = tmax;
+			for (int axis = 0; axis < 3; axis++) {
+				entry = std::max(entry, (nearBounds[axis][lane] - ray.origin[axis]) * ray.inverse[axis]);
+				exit = std::min(exit, (farBounds[axis][lane] - ray.origin[axis]) * ray.inverse[axis]);
+			}
+			entries[lane] = entry;
+			if (entry <= exit)
+				mask |= 1 << lane;
+		}
+		return mask;
+#endif
+	}
+}
+
+template <int WIDTH>
+void WideBVH<WIDTH>::build(Triangle* triangles, uint32_t count, float minVal, float maxVal, const BuildSettings& settings) {
+	this->settings = settings;
+	triangleData = triangles;
+	triangleCount = count;
+	binary.build(triangles, count, minVal, maxVal, settings);
+	collapse();
+}
+
+template <int WIDTH>
+UpdateResult WideBVH<WIDTH>::update(const std::vector<uint32_t>& changed) {
+	UpdateResult result = binary.update(changed);
+	collapse();
+	return result;
+}
+
+// rebuilds the wide nodes from the current binary hierarchy
+template <int WIDTH>
+void WideBVH<WIDTH>::collapse() {
+	if (arena.usesHugePages() != settings.hugePages)
+		arena = Arena(settings.hugePages);
+	arena.reset();
+	nodes = ArenaArray<WideNode<WIDTH>>();
+	boxes = ArenaArray<Box>();
+	boxesStored = false;
+	boundsMin = binary.boundsMin;
+	boundsMax = binary.boundsMax;
+	degradation = binary.degradation;
+	if (binary.nodes.empty())
+		return;
+
+	// every wide node opens at least one interior binary node, only a root leaf gets a wide node of its own
+	nodes = arena.allocateArray<WideNode<WIDTH>>(binary.nodes.size() / 2 + 1);
+	nodes.count = 0;
+	collapseNode(0);
+}
+
+// the binary node is opened into its children, then the interior child with the largest surface is opened again until
+// WIDTH children are collected, large children are the ones most rays enter and gain the most from being tested together
+template <int WIDTH>
+uint32_t WideBVH<WIDTH>::collapseNode(uint32_t binaryNode) {
+	uint32_t children[WIDTH];
+	int childCount = 1;
+	children[0] = binaryNode;
+	while (childCount < WIDTH) {
+		int open = -1;
+		float openArea = -1.0f;
+		for (int i = 0; i < childCount; i++) {
+			const BVHNode& child = binary.nodes[children[i]];
+			if (!child.isLeaf() && halfArea(child) > openArea) {
+				open = i;
+				openArea = halfArea(child);
+			}
+		}
+		if (open < 0)
+			break;
+		uint32_t left = binary.nodes[children[open]].first;
+		children[open] = left;
+		children[childCount++] = left + 1;
+	}
+
+	uint32_t index = (uint32_t)nodes.count++;
+	WideNode<WIDTH>& node = nodes[index];
+	for (int lane = 0; lane < WIDTH; lane++) {
+		for (int axis = 0; axis < 3; axis++) {
+			node.boundsMin[axis][lane] = std::numeric_limits<float>::infinity();
+			node.boundsMax[axis][lane] = -std::numeric_limits<float>::infinity();
+		}
+		node.child[lane] = 0;
+		node.count[lane] = 0;
+	}
+	for (int lane = 0; lane < childCount; lane++) {
+		const BVHNode& child = binary.nodes[children[lane]];
+		for (int axis = 0; axis < 3; axis++) {
+			node.boundsMin[axis][lane] = child.boundsMin[axis];
+			node.boundsMax[axis][lane] = child.boundsMax[axis];
+		}
+		node.child[lane] = child.isLeaf() ? child.first : collapseNode(children[lane]);
+		node.count[lane] = child.count;
+	}
+	return index;
+}
+
+// visits the children in the order the ray enters them and keeps the closest hit, children entered behind it are skipped
+template <int WIDTH>
+Triangle* WideBVH<WIDTH>::findHit(const float* point, const float* direction, float tmax, TriangleHit& hit, TraversalContext& context) const {
+	if (nodes.empty())
+		return nullptr;
+	glm::vec3 origin(point[0], point[1], point[2]);
+	glm::vec3 dir(direction[0], direction[1], direction[2]);
+	WatertightRay triangleRay(origin, dir);
+	SlabRay ray;
+	for (int axis = 0; axis < 3; axis++) {
+		ray.origin[axis] = origin[axis];
+		ray.inverse[axis] = 1.0f / dir[axis];
+		ray.negative[axis] = std::signbit(ray.inverse[axis]);
+	}
+
+	Triangle* result = nullptr;
+	TriangleHit resultHit;
+	float best = tmax;
+
+	// every visited node pushes at most WIDTH children
+	uint32_t* stackChild = context.node + context.base;
+	uint32_t* stackCount = context.count + context.base;
+	float* stackEntry = context.entry + context.base;
+	int stackSize = 0;
+	stackChild[0] = 0;
+	stackCount[0] = 0;
+	stackEntry[0] = 0.0f;
+	stackSize++;
+	while (stackSize > 0) {
+		stackSize--;
+		StackEntry current = StackEntry{ stackChild[stackSize], stackCount[stackSize], stackEntry[stackSize] };
+		if (current.entry > best)
+			continue;
+		if (current.count > 0) {
+			int found = intersectTriangles(triangleRay, binary.records, current.child, current.count, best, resultHit);
+			if (found >= 0) {
+				best = resultHit.t;
+				result = &triangleData[binary.triangleIndices[current.child + found]];
+			}
+			continue;
+		}
+
+		const WideNode<WIDTH>& node = nodes[current.child];
+		float entries[WIDTH];
+		int mask = intersectChildren(node, ray, best, entries);
+		// the entered children are sorted farthest first and pushed in that order, so the nearest one is visited next
+		StackEntry entered[WIDTH];
+		int enteredCount = 0;
+		for (int lane = 0; lane < WIDTH; lane++) {
+			if ((mask & (1 << lane)) == 0)
+				continue;
+			int position = enteredCount++;
+			while (position > 0 && entered[position - 1].entry < entries[lane]) {
+				entered[position] = entered[position - 1];
+				position--;
+			}
+			entered[position] = StackEntry{ node.child[lane], node.count[lane], entries[lane] };
+		}
+		for (int i = 0; i < enteredCount; i++) {
+			stackChild[stackSize] = entered[i].child;
+			stackCount[stackSize] = entered[i].count;
+			stackEntry[stackSize] = entered[i].entry;
+			stackSize++;
+		}
+	}
+
+	if (result != nullptr)
+		hit = resultHit;
+	return result;
+}
+
+// the children the ray enters are pushed unsorted, the first triangle hit within [0, tmax] ends the search
+template <int WIDTH>
+bool WideBVH<WIDTH>::occluded(const float* point, const float* direction, float tmax, TraversalContext& context) const {
+	if (nodes.empty())
+		return false;
+	glm::vec3 origin(point[0], point[1], point[2]);
+	glm::vec3 dir(direction[0], direction[1], direction[2]);
+	WatertightRay triangleRay(origin, dir);
+	SlabRay ray;
+	for (int axis = 0; axis < 3; axis++) {
+		ray.origin[axis] = origin[axis];
+		ray.inverse[axis] = 1.0f / dir[axis];
+		ray.negative[axis] = std::signbit(ray.inverse[axis]);
+	}
+
+	uint32_t* stack = context.node + context.base;
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+	while (stackSize > 0) {
+		const WideNode<WIDTH>& node = nodes[stack[--stackSize]];
+		float entries[WIDTH];
+		int mask = intersectChildren(node, ray, tmax, entries);
+		for (int lane = 0; lane < WIDTH; lane++) {
+			if ((mask & (1 << lane)) == 0)
+				continue;
+			if (node.count[lane] == 0) {
+				stack[stackSize++] = node.child[lane];
+				continue;
+			}
+			TriangleHit hit;
+			if (intersectTriangles(triangleRay, binary.records, node.child[lane], node.count[lane], tmax, hit) >= 0)
+				return true;
+		}
+	}
+	return false;
+}
+
+// expected cost of a ray through the scene, comparable with the other structures
+// one slab test covers all children of a node, so a wide node costs as much to visit as a binary one
+template <int WIDTH>
+float WideBVH<WIDTH>::expectedCost() const {
+	float area = halfArea(boundsMin, boundsMax);
+	if (nodes.empty() || area <= 0.0f)
+		return 0.0f;
+	float cost = 0.0f;
+	for (const WideNode<WIDTH>& node : nodes) {
+		glm::vec3 nodeMin(std::numeric_limits<float>::infinity()), nodeMax(-std::numeric_limits<float>::infinity());
+		for (int lane = 0; lane < WIDTH; lane++) {
+			glm::vec3 childMin(node.boundsMin[0][lane], node.boundsMin[1][lane], node.boundsMin[2][lane]);
+			glm::vec3 childMax(node.boundsMax[0][lane], node.boundsMax[1][lane], node.boundsMax[2][lane]);
+			nodeMin = glm::min(nodeMin, childMin);
+			nodeMax = glm::max(nodeMax, childMax);
+			if (node.count[lane] > 0)
+				cost += halfArea(childMin, childMax) * settings.intersectionCost * node.count[lane];
+		}
+		cost += halfArea(nodeMin, nodeMax) * settings.traversalCost;
+	}
+	return cost / area;
+}
+
+template <int WIDTH>
+AccelerationStats WideBVH<WIDTH>::stats() const {
+	AccelerationStats result;
+	result.nodes = nodes.size();
+	result.bytes = nodes.size() * sizeof(WideNode<WIDTH>) + binary.triangleIndices.size() * sizeof(uint32_t) + binary.records.bytes();
+	result.expectedCost = expectedCost();
+	if (nodes.empty())
+		return result;
+	std::vector<std::pair<uint32_t, int>> stack(1, std::make_pair(0u, 0));
+	while (!stack.empty()) {
+		const WideNode<WIDTH>& node = nodes[stack.back().first];
+		int level = stack.back().second;
+		stack.pop_back();
+		for (int lane = 0; lane < WIDTH; lane++) {
+			if (node.count[lane] > 0) {
+				result.leaves++;
+				result.references += node.count[lane];
+				result.depth = std::max(result.depth, level + 1);
+			}
+			else if (node.boundsMin[0][lane] <= node.boundsMax[0][lane]) {
+				stack.push_back(std::make_pair(node.child[lane], level + 1));
+			}
+		}
+	}
+	return result;
+}
+
+// the boxes are the bounds of the wide nodes
+template <int WIDTH>
+void WideBVH<WIDTH>::storeBoxes() {
+	boxes = arena.allocateArray<Box>(nodes.size());
+	for (size_t i = 0; i < nodes.size(); i++) {
+		const WideNode<WIDTH>& node = nodes[i];
+		float nodeMin[3], nodeMax[3];
+		for (int axis = 0; axis < 3; axis++) {
+			nodeMin[axis] = *std::min_element(node.boundsMin[axis], node.boundsMin[axis] + WIDTH);
+			nodeMax[axis] = *std::max_element(node.boundsMax[axis], node.boundsMax[axis] + WIDTH);
+		}
+		boxes[i] = Box(nodeMin[0], nodeMax[0], nodeMin[1], nodeMax[1], nodeMin[2], nodeMax[2]);
+	}
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
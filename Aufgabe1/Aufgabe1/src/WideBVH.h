@@ -0,0 +1,48 @@
+#pragma once
+#include "BVH.h"
+#include <vector>
+#include <cstdint>
+
+// node of the wide hierarchy, the bounds of the children are stored axis by axis so one SIMD slab test covers all of them
+// interior children have a count of 0 and keep their node index in child, leaves keep the start of their triangle list
+// unused slots have empty bounds that no ray enters
+template <int WIDTH>
+struct alignas(WIDTH * sizeof(float)) WideNode {
+	float boundsMin[3][WIDTH];
+	float boundsMax[3][WIDTH];
+	uint32_t child[WIDTH];
+	uint32_t count[WIDTH];
+};
+
+/**
+ * Bounding volume hierarchy with up to WIDTH children per node, collapsed from a binary BVH.
+ * A ray is tested against all children of a node at once with SSE (4 wide) or AVX (8 wide), which replaces
+ * several dependent steps of the binary traversal by one, and the children are visited in the order the ray enters them.
+ * The binary hierarchy is kept to refit and rebuild it on updates, the wide nodes are collapsed from it again afterwards.
+ * The leaves test the triangle records of the binary hierarchy, they reference the same ranges of its triangle list.
+ */
+template <int WIDTH>
+class WideBVH : public AccelerationStructure {
+	static_assert(WIDTH == 4 || WIDTH == 8, "the slab tests are written for 4 and 8 children");
+
+	BVH binary;
+
+	void collapse();
+	uint32_t collapseNode(uint32_t binaryNode);
+	void storeBoxes() override;
+public:
+	Arena arena;					// owns the wide nodes and the boxes
+	ArenaArray<WideNode<WIDTH>> nodes;	// the root is the first node, children always follow their parent
+	WideBVH() {};
+	using AccelerationStructure::build;
+	using AccelerationStructure::update;
+	void build(Triangle* triangles, uint32_t count, float minVal, float maxVal, const BuildSettings& settings) override;
+	UpdateResult update(const std::vector<uint32_t>& changed) override;
+	Triangle* findHit(const float* point, const float* direction, float tmax, TriangleHit& hit, TraversalContext& context) const override;
+	bool occluded(const float* point, const float* direction, float tmax, TraversalContext& context) const override;
+	AccelerationStats stats() const override;
+	float expectedCost() const;
+};
+
+typedef WideBVH<4> BVH4;
+typedef WideBVH<8> BVH8;
@@ -19,6 +19,13 @@
 #include <random>
 #include "Triangle.h"
 #include "KDTree.h"
+#include "BVH.h"
+#include "WideBVH.h"
+#include "InstancedBVH.h"
+#include "TreeCache.h"
+#include "Timing.h"
+#include <sstream>
+#include <numeric>
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void processInput(GLFWwindow* window);
@@ -26,7 +33,11 @@ void keyboardCallback(GLFWwindow* window, int key, int scancode, int action, int
 unsigned int loadTexture(const char* path);
 void restartScene();
 void renderCube();
-void renderScene(const Shader& shader, const glm::vec3 cubePos[]);
+void renderScene(const Shader& shader, const glm::vec3 cubePos[], const std::vector<uint32_t>& visible);
+void cullTriangles(const glm::mat4& viewProjection, std::vector<uint32_t>& visible);
+void runBenchmark();
+void moveTriangles(std::default_random_engine& engine, std::vector<uint32_t>& changed, std::vector<glm::mat4>& modelMatrices);
+UpdateResult animateTriangles(AccelerationStructure& animatedStructure, std::default_random_engine& engine);
 
 // calculation functions
 int calcCorrectIndex(int index);
@@ -61,9 +72,24 @@ unsigned int wireCubeVBO;
 int triangleAmount = 40;
 int maxVal = 10;
 int minVal = -maxVal;
-std::vector<Triangle> triangles;
+std::vector<Triangle> generatedTriangles;
+ArenaArray<Triangle> triangles;	// the generated triangles or the ones mapped from the cache file
+BuildSettings buildSettings;
+bool benchmark = false;
+float animatedFraction = 0.0f;	// part of the triangles that is moved every frame
 KDTree tree;
+BVH bvh;
+BVH4 bvh4;
+BVH8 bvh8;
+InstancedBVH instanced;
+AccelerationStructure* accelerator = &tree;	// the structure that answers the picking rays
+bool useCache = false;	// load the tree from a cache file instead of building it, the file is written if it is missing
+TreeCache cache;
 Triangle* lastResult;
+glm::vec3 lastPoint = glm::vec3(0.0f);	// where the last picking ray hit lastResult
+TraversalContext pickingContext;	// traversal memory of the picking rays, which are cast by the render thread
+TraversalContext cullingContext;	// traversal memory of the frustum queries of the render passes
+std::vector<uint32_t> visibleTriangles;	// triangles inside the view volume of the current pass
 
 //mouse values
 double mouseX, mouseY;
@@ -98,7 +124,7 @@ glm::vec3 CreateRay(const glm::mat4& projection, const glm::mat4& view) {
 }
 
 void printUsage() {
-	std::cerr << "Usage: Aufgabe1.exe --samples [sampling mode] --triangles triangleAmount --extremes " << std::endl;
+	std::cerr << "Usage: Aufgabe1.exe --samples [sampling mode] --triangles triangleAmount --extremes --structure [kdtree|bvh|bvh4|bvh8|instanced] --build [median|sah|binned] --threads threadCount --leafSize maxTriangles --depth maxDepth --clip --hugePages --lazy --animate movingFraction --cache --benchmark" << std::endl;
 }
 
 int main(int argc, char* argv[])
@@ -150,23 +176,182 @@ int main(int argc, char* argv[])
 				return 1;
 			}
 		}
+		else if (std::string(argv[i]) == "--structure") {
+			if (i + 1 < argc) {
+				if (std::string(argv[i + 1]) == "kdtree") {
+					accelerator = &tree;
+				}
+				else if (std::string(argv[i + 1]) == "bvh") {
+					accelerator = &bvh;
+				}
+				else if (std::string(argv[i + 1]) == "bvh4") {
+					accelerator = &bvh4;
+				}
+				else if (std::string(argv[i + 1]) == "bvh8") {
+					accelerator = &bvh8;
+				}
+				else if (std::string(argv[i + 1]) == "instanced") {
+					accelerator = &instanced;
+				}
+				else {
+					printUsage();
+					return 1;
+				}
+			}
+			else {
+				printUsage();
+				return 1;
+			}
+		}
+		else if (std::string(argv[i]) == "--animate") {
+			if (i + 1 < argc) {
+				if (std::stof(argv[i + 1]) >= 0.0f && std::stof(argv[i + 1]) <= 1.0f) {
+					animatedFraction = std::stof(argv[i + 1]);
+				}
+				else {
+					printUsage();
+					return 1;
+				}
+			}
+			else {
+				printUsage();
+				return 1;
+			}
+		}
+		else if (std::string(argv[i]) == "--hugePages") {
+			buildSettings.hugePages = true;
+		}
+		else if (std::string(argv[i]) == "--lazy") {
+			buildSettings.lazy = true;
+		}
+		else if (std::string(argv[i]) == "--clip") {
+			buildSettings.exactClipping = true;
+		}
+		else if (std::string(argv[i]) == "--cache") {
+			useCache = true;
+		}
+		else if (std::string(argv[i]) == "--benchmark") {
+			benchmark = true;
+		}
+		else if (std::string(argv[i]) == "--threads") {
+			if (i + 1 < argc) {
+				if (std::stoi(argv[i + 1]) >= 0) {
+					buildSettings.threads = std::stoi(argv[i + 1]);
+				}
+				else {
+					printUsage();
+					return 1;
+				}
+			}
+			else {
+				printUsage();
+				return 1;
+			}
+		}
+		else if (std::string(argv[i]) == "--leafSize") {
+			if (i + 1 < argc) {
+				if (std::stoi(argv[i + 1]) > 0) {
+					buildSettings.maxLeafSize = std::stoi(argv[i + 1]);
+				}
+				else {
+					printUsage();
+					return 1;
+				}
+			}
+			else {
+				printUsage();
+				return 1;
+			}
+		}
+		else if (std::string(argv[i]) == "--depth") {
+			if (i + 1 < argc) {
+				if (std::stoi(argv[i + 1]) >= 0) {
+					buildSettings.maxDepth = std::stoi(argv[i + 1]);
+				}
+				else {
+					printUsage();
+					return 1;
+				}
+			}
+			else {
+				printUsage();
+				return 1;
+			}
+		}
+		else if (std::string(argv[i]) == "--build") {
+			if (i + 1 < argc) {
+				if (std::string(argv[i + 1]) == "median") {
+					buildSettings.mode = BuildMode::Median;
+				}
+				else if (std::string(argv[i + 1]) == "sah") {
+					buildSettings.mode = BuildMode::SAH;
+				}
+				else if (std::string(argv[i + 1]) == "binned") {
+					buildSettings.mode = BuildMode::Binned;
+				}
+				else {
+					printUsage();
+					return 1;
+				}
+			}
+			else {
+				printUsage();
+				return 1;
+			}
+		}
 	}
 
-	//create random triangles in range [minValue, maxValue]
-	std::default_random_engine e1(1234);
-	std::uniform_int_distribution<int> uniform_dist(minVal, maxVal);
-
-	for (int i = 0; i < triangleAmount; i++) {
-		glm::mat4 model = glm::mat4(1.0f);
-		model = glm::translate(model, glm::vec3(uniform_dist(e1), uniform_dist(e1), uniform_dist(e1)));
-		model = glm::rotate(model, (float)uniform_dist(e1), glm::vec3(1, 0, 0));
-		//model = glm::rotate(model, (float)90, glm::vec3(1, 0, 0));
-		model = glm::rotate(model, (float)uniform_dist(e1), glm::vec3(0, 1, 0));
-		model = glm::rotate(model, (float)uniform_dist(e1), glm::vec3(0, 0, 1));
-		triangles.push_back(Triangle(model));
+	// the scene is identified by everything the triangles and the tree are derived from
+	// the thread count is left out, every thread count builds the same tree
+	const unsigned int seed = 1234;
+	uint64_t sceneKey = TreeCache::HASH_START;
+	sceneKey = TreeCache::hash(sceneKey, seed);
+	sceneKey = TreeCache::hash(sceneKey, triangleAmount);
+	sceneKey = TreeCache::hash(sceneKey, minVal);
+	sceneKey = TreeCache::hash(sceneKey, maxVal);
+	sceneKey = TreeCache::hash(sceneKey, buildSettings.mode);
+	sceneKey = TreeCache::hash(sceneKey, buildSettings.traversalCost);
+	sceneKey = TreeCache::hash(sceneKey, buildSettings.intersectionCost);
+	sceneKey = TreeCache::hash(sceneKey, buildSettings.bins);
+	sceneKey = TreeCache::hash(sceneKey, buildSettings.maxLeafSize);
+	sceneKey = TreeCache::hash(sceneKey, buildSettings.maxDepth);
+	sceneKey = TreeCache::hash(sceneKey, buildSettings.exactClipping);
+	sceneKey = TreeCache::hash(sceneKey, buildSettings.lazy);
+	std::stringstream cachePath;
+	cachePath << "kdtree_" << std::hex << sceneKey << ".cache";
+
+	// only the KD-tree can be stored in the cache
+	useCache = useCache && accelerator == &tree;
+	if (useCache && !benchmark && cache.load(cachePath.str(), sceneKey, buildSettings, tree)) {
+		triangles = cache.triangles;
+		std::cout << "Loaded the tree from " << cachePath.str() << std::endl;
 	}
+	else {
+		//create random triangles in range [minValue, maxValue]
+		std::default_random_engine e1(seed);
+		std::uniform_int_distribution<int> uniform_dist(minVal, maxVal);
 
-	tree = KDTree(triangles, minVal, maxVal);
+		for (int i = 0; i < triangleAmount; i++) {
+			glm::mat4 model = glm::mat4(1.0f);
+			model = glm::translate(model, glm::vec3(uniform_dist(e1), uniform_dist(e1), uniform_dist(e1)));
+			model = glm::rotate(model, (float)uniform_dist(e1), glm::vec3(1, 0, 0));
+			//model = glm::rotate(model, (float)90, glm::vec3(1, 0, 0));
+			model = glm::rotate(model, (float)uniform_dist(e1), glm::vec3(0, 1, 0));
+			model = glm::rotate(model, (float)uniform_dist(e1), glm::vec3(0, 0, 1));
+			generatedTriangles.push_back(Triangle(model));
+		}
+		triangles.items = generatedTriangles.data();
+		triangles.count = generatedTriangles.size();
+
+		if (benchmark) {
+			runBenchmark();
+			return 0;
+		}
+
+		accelerator->build(triangles.data(), (uint32_t)triangles.size(), minVal, maxVal, buildSettings);
+		if (useCache && !TreeCache::write(cachePath.str(), sceneKey, tree))
+			std::cerr << "Could not write " << cachePath.str() << std::endl;
+	}
 
     // glfw: initialize and configure
     glfwInit();
@@ -403,8 +588,13 @@ int main(int argc, char* argv[])
 	}
 
     // render loop
+	std::default_random_engine animationEngine(5678);
     while (!glfwWindowShouldClose(window))
     {
+		if (animatedFraction > 0.0f) {
+			animateTriangles(*accelerator, animationEngine);
+		}
+
 		if (t < 1) {
             t += increment;
 		}
@@ -445,7 +635,9 @@ int main(int argc, char* argv[])
 		glBindTexture(GL_TEXTURE_2D, diffuseMap);
 		glActiveTexture(GL_TEXTURE1);
 		glBindTexture(GL_TEXTURE_2D, normalMap);
-		renderScene(depthShader, cubePositions);
+		// triangles outside of the light's volume can't cast a shadow into the map
+		cullTriangles(lightSpaceMatrix, visibleTriangles);
+		renderScene(depthShader, cubePositions, visibleTriangles);
 		glCullFace(GL_BACK);
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
@@ -489,7 +681,8 @@ int main(int argc, char* argv[])
 		glActiveTexture(GL_TEXTURE2);
 		glBindTexture(GL_TEXTURE_2D, depthMap);
 
-		renderScene(ourShader, cubePositions);
+		cullTriangles(projection * view, visibleTriangles);
+		renderScene(ourShader, cubePositions, visibleTriangles);
 
 		// we test if we need to create a new raycast and if so search the tree for a hit
 		if (clickX > 0 && clickY > 0 && clickX < SCR_WIDTH && clickY < SCR_HEIGHT) {
@@ -497,21 +690,19 @@ int main(int argc, char* argv[])
 			glm::vec3 ray = CreateRay(projection, view);
 			//std::cout << ray.x << " " << ray.y << " " << ray.z << std::endl;
 
-			float camPos[3] = { movePoint.x, movePoint.y, movePoint.z };
-			//float camPos[3] = { cameraPos.x, cameraPos.y, cameraPos.z };
-			float rayDir[3] = { ray.x, ray.y, ray.z };
-
-			Triangle* result = tree.searchHit(camPos, rayDir, 100);
-			if (result != nullptr) {
-				lastResult = result;
+			RayHit hit = accelerator->query(movePoint, ray, 100, pickingContext);
+			//RayHit hit = accelerator->query(cameraPos, ray, 100, pickingContext);
+			if (hit.found()) {
+				lastResult = &accelerator->triangleData[hit.triangle];
+				lastPoint = hit.point;
 			}
 
 			clickX = -10;
 			clickY = -10;
-			std::cout << tree.lastPoint.x << " " << tree.lastPoint.y << " " << tree.lastPoint.z << std::endl;
+			std::cout << lastPoint.x << " " << lastPoint.y << " " << lastPoint.z << std::endl;
 		}
 
-		if (tree.lastPoint.x != 0 && tree.lastPoint.y != 0 && tree.lastPoint.z != 0) {
+		if (lastPoint.x != 0 && lastPoint.y != 0 && lastPoint.z != 0) {
 			glBindVertexArray(triangleVAO);
 			pointShader.use();
 			pointShader.setMat4("projection", projection);
@@ -528,7 +719,7 @@ int main(int argc, char* argv[])
 			pointShader.setMat4("view", view);
 			glm::mat4 model = glm::mat4(1.0f);
 			// we draw the intersection point
-			model = glm::translate(model, tree.lastPoint);
+			model = glm::translate(model, lastPoint);
 			model = glm::translate(model, glm::vec3(0.0f, 0.0f, 0.01f));
 			pointShader.setVec3("color", glm::vec3(1.0f, 0.0f, 0.0f));
 			pointShader.setMat4("model", model);
@@ -542,7 +733,7 @@ int main(int argc, char* argv[])
 			pointShader.setMat4("view", view);
 			glm::mat4 model = glm::mat4(1.0f);
 			glBindVertexArray(wireCubeVAO);
-			for (auto box : tree.boxes) {
+			for (auto box : accelerator->nodeBoxes()) {
 				model = glm::mat4(1.0f);
 				box.getTransformMatrix(model);
 				pointShader.setVec3("color", glm::vec3(0.0f, 0.0f, 1.0f));
@@ -566,7 +757,17 @@ int main(int argc, char* argv[])
     return 0;
 }
 
-void renderScene(const Shader& shader, const glm::vec3 cubePos[])
+// the triangles inside the view volume of the matrix, the other structures have no frustum query and draw every triangle
+void cullTriangles(const glm::mat4& viewProjection, std::vector<uint32_t>& visible) {
+	if (accelerator == &tree) {
+		tree.trianglesInFrustum(Frustum::fromMatrix(viewProjection), visible, cullingContext);
+		return;
+	}
+	visible.resize(triangles.size());
+	std::iota(visible.begin(), visible.end(), 0u);
+}
+
+void renderScene(const Shader& shader, const glm::vec3 cubePos[], const std::vector<uint32_t>& visible)
 {
 	//floor plane
 	glm::mat4 model = glm::mat4(1.0f);
@@ -577,8 +778,8 @@ void renderScene(const Shader& shader, const glm::vec3 cubePos[])
 
 	//triangles
 	glBindVertexArray(triangleVAO);
-	for (auto triangle : triangles) {
-		shader.setMat4("model", triangle.getModelMat());
+	for (uint32_t triangle : visible) {
+		shader.setMat4("model", triangles[triangle].getModelMat());
 		glDrawArrays(GL_TRIANGLES, 0, 3);
 	}
 
@@ -593,6 +794,180 @@ void renderScene(const Shader& shader, const glm::vec3 cubePos[])
 	//}
 }
 
+// builds the tree with every build mode and compares the build time with the traversal cost of the result
+void runBenchmark() {
+	// the KD-tree with every build mode and the BVHs including the two level one, which always use their binned build
+	const int modeAmount = 7;
+	const char* modeNames[modeAmount] = { "median", "sah", "binned", "bvh", "bvh4", "bvh8", "instanced" };
+	const BuildMode modes[modeAmount] = { BuildMode::Median, BuildMode::SAH, BuildMode::Binned, BuildMode::Binned, BuildMode::Binned, BuildMode::Binned, BuildMode::Binned };
+	KDTree benchmarkTree;
+	BVH benchmarkBVH;
+	BVH4 benchmarkBVH4;
+	BVH8 benchmarkBVH8;
+	InstancedBVH benchmarkInstanced;
+	AccelerationStructure* structures[modeAmount] = { &benchmarkTree, &benchmarkTree, &benchmarkTree, &benchmarkBVH, &benchmarkBVH4, &benchmarkBVH8, &benchmarkInstanced };
+
+	// every structure gets the same random rays through the scene
+	const int rayAmount = 100000;
+	std::default_random_engine e2(4321);
+	std::uniform_real_distribution<float> position((float)minVal, (float)maxVal);
+	std::uniform_real_distribution<float> direction(-1.0f, 1.0f);
+	std::vector<glm::vec3> rayOrigins(rayAmount), rayDirections(rayAmount);
+	for (int i = 0; i < rayAmount; i++) {
+		rayOrigins[i] = glm::vec3(position(e2), position(e2), position(e2));
+		rayDirections[i] = glm::normalize(glm::vec3(direction(e2), direction(e2), direction(e2)));
+	}
+
+	// camera rays through the pixels of an image in front of the scene, neighbouring pixels form the packets
+	const int imageSize = 256;
+	const int tileSize = 4;	// tileSize * tileSize rays per packet
+	const float cameraDistance = 3.0f * maxVal;
+	std::vector<glm::vec3> cameraOrigins, cameraDirections;
+	for (int tileY = 0; tileY < imageSize; tileY += tileSize) {
+		for (int tileX = 0; tileX < imageSize; tileX += tileSize) {
+			for (int y = tileY; y < tileY + tileSize; y++) {
+				for (int x = tileX; x < tileX + tileSize; x++) {
+					cameraOrigins.push_back(glm::vec3(0.0f, 0.0f, cameraDistance));
+					cameraDirections.push_back(glm::normalize(glm::vec3((x + 0.5f) / imageSize - 0.5f, (y + 0.5f) / imageSize - 0.5f, -1.0f)));
+				}
+			}
+		}
+	}
+	std::vector<Triangle*> cameraHits(cameraOrigins.size());
+	std::vector<TriangleHit> cameraIntersections(cameraOrigins.size());
+	HitBuffer batchHits;
+	ThreadPool batchPool(buildSettings.threads);	// traces every batch, so the threads are started once
+
+	// the KD-trees are built one after the other into the same memory
+	Timing* timing = Timing::getInstance();
+	for (int i = 0; i < modeAmount; i++) {
+		BuildSettings settings = buildSettings;
+		settings.mode = modes[i];
+		std::string name = modeNames[i];
+		AccelerationStructure& structure = *structures[i];
+
+		timing->startRecord(name + " build");
+		structure.build(generatedTriangles, minVal, maxVal, settings);
+		timing->stopRecord(name + " build");
+
+		// a lazy tree builds the nodes the first ray needs on the way
+		int hits = 0;
+		timing->startRecord(name + " first ray");
+		if (structure.searchHit(glm::value_ptr(rayOrigins[0]), glm::value_ptr(rayDirections[0]), 100) != nullptr)
+			hits++;
+		timing->stopRecord(name + " first ray");
+		timing->startRecord(name + " rays");
+		for (int ray = 1; ray < rayAmount; ray++) {
+			if (structure.searchHit(glm::value_ptr(rayOrigins[ray]), glm::value_ptr(rayDirections[ray]), 100) != nullptr)
+				hits++;
+		}
+		timing->stopRecord(name + " rays");
+		// shadow and visibility rays only need to know whether anything is in the way
+		// the benchmark runs before the render loop, so it borrows the memory of the picking rays
+		int occluded = 0;
+		timing->startRecord(name + " occlusion rays");
+		for (int ray = 0; ray < rayAmount; ray++) {
+			if (structure.occluded(glm::value_ptr(rayOrigins[ray]), glm::value_ptr(rayDirections[ray]), 100, pickingContext))
+				occluded++;
+		}
+		timing->stopRecord(name + " occlusion rays");
+
+		timing->startRecord(name + " camera rays");
+		for (size_t ray = 0; ray < cameraOrigins.size(); ray++) {
+			cameraHits[ray] = structure.searchHit(glm::value_ptr(cameraOrigins[ray]), glm::value_ptr(cameraDirections[ray]), 2.0f * cameraDistance);
+		}
+		timing->stopRecord(name + " camera rays");
+		timing->startRecord(name + " camera packets");
+		for (size_t ray = 0; ray < cameraOrigins.size(); ray += tileSize * tileSize) {
+			structure.searchPacket(tileSize * tileSize, &cameraOrigins[ray], &cameraDirections[ray], 2.0f * cameraDistance, &cameraHits[ray], &cameraIntersections[ray], pickingContext);
+		}
+		timing->stopRecord(name + " camera packets");
+
+		// the random rays once more as batches traced by the build threads, in their own order and sorted for coherence
+		BatchSettings batchSettings;
+		batchSettings.pool = &batchPool;
+		timing->startRecord(name + " batch");
+		structure.searchBatch(rayOrigins.size(), rayOrigins.data(), rayDirections.data(), 100, batchHits, batchSettings);
+		timing->stopRecord(name + " batch");
+		batchSettings.sortRays = true;
+		timing->startRecord(name + " sorted batch");
+		structure.searchBatch(rayOrigins.size(), rayOrigins.data(), rayDirections.data(), 100, batchHits, batchSettings);
+		timing->stopRecord(name + " sorted batch");
+
+		AccelerationStats stats = structure.stats();
+		std::cout << name << ": expected SAH cost " << stats.expectedCost << ", " << hits << " of " << rayAmount << " rays hit, " << occluded << " occluded, "
+			<< stats.nodes << " nodes, " << stats.leaves << " leaves, " << stats.references << " triangle references, depth " << stats.depth << ", "
+			<< stats.bytes / 1024 << " KB" << std::endl;
+	}
+
+	// animated scene, the same moves are applied once with updates and once with full rebuilds of the structure
+	if (animatedFraction > 0.0f) {
+		const int frameAmount = 100;
+		std::vector<Triangle> original = generatedTriangles;
+		for (int i = 0; i < modeAmount; i++) {
+			BuildSettings settings = buildSettings;
+			settings.mode = modes[i];
+			std::string name = modeNames[i];
+			AccelerationStructure& structure = *structures[i];
+
+			generatedTriangles = original;
+			structure.build(generatedTriangles, minVal, maxVal, settings);
+			std::default_random_engine updateEngine(5678);
+			int partial = 0, full = 0;
+			timing->startRecord(name + " updates");
+			for (int frame = 0; frame < frameAmount; frame++) {
+				UpdateResult result = animateTriangles(structure, updateEngine);
+				if (result == UpdateResult::PartialRebuild)
+					partial++;
+				else if (result == UpdateResult::FullRebuild)
+					full++;
+			}
+			timing->stopRecord(name + " updates");
+			std::cout << name << ": " << frameAmount << " updates, " << partial << " partial and " << full << " full rebuilds, cost "
+				<< structure.degradation << " times the last build" << std::endl;
+
+			generatedTriangles = original;
+			structure.build(generatedTriangles, minVal, maxVal, settings);
+			std::default_random_engine rebuildEngine(5678);
+			std::vector<uint32_t> changed;
+			std::vector<glm::mat4> modelMatrices;
+			timing->startRecord(name + " rebuilds");
+			for (int frame = 0; frame < frameAmount; frame++) {
+				moveTriangles(rebuildEngine, changed, modelMatrices);
+				for (size_t moved = 0; moved < changed.size(); moved++) {
+					generatedTriangles[changed[moved]] = Triangle(modelMatrices[moved]);
+				}
+				structure.build(generatedTriangles, minVal, maxVal, settings);
+			}
+			timing->stopRecord(name + " rebuilds");
+		}
+		generatedTriangles = original;
+	}
+	timing->print();
+}
+
+// picks a random part of the triangles and moves each of them a little
+void moveTriangles(std::default_random_engine& engine, std::vector<uint32_t>& changed, std::vector<glm::mat4>& modelMatrices) {
+	int movedAmount = (int)(animatedFraction * triangles.size());
+	std::uniform_int_distribution<int> pick(0, std::max((int)triangles.size() - 1, 0));
+	std::uniform_real_distribution<float> offset(-0.1f, 0.1f);
+	changed.resize(movedAmount);
+	modelMatrices.resize(movedAmount);
+	for (int i = 0; i < movedAmount; i++) {
+		changed[i] = pick(engine);
+		glm::vec3 move(offset(engine), offset(engine), offset(engine));
+		modelMatrices[i] = glm::translate(glm::mat4(1.0f), move) * triangles[changed[i]].getModelMat();
+	}
+}
+
+// moves a random part of the triangles and updates the structure
+UpdateResult animateTriangles(AccelerationStructure& animatedStructure, std::default_random_engine& engine) {
+	std::vector<uint32_t> changed;
+	std::vector<glm::mat4> modelMatrices;
+	moveTriangles(engine, changed, modelMatrices);
+	return animatedStructure.update(changed, modelMatrices);
+}
+
 unsigned int cubeVAO = 0;
 unsigned int cubeVBO = 0;
 void renderCube()